@@ -1,2 +1,14 @@
 extern int nixexec_argc;
 extern char ** nixexec_argv;
+extern unsigned long nixexec_dlopen_cache_hits;
+extern unsigned long nixexec_dlopen_cache_misses;
+extern unsigned long nixexec_store_realisations;
+extern unsigned long nixexec_fetchgit_cache_hits;
+extern unsigned long nixexec_fetchgit_cache_misses;
+
+/* The entry point of a plugin run with async-dlopen. It's called on a worker
+ * thread, so it must not touch the evaluator, with its arguments encoded as a
+ * JSON list. It returns its result as JSON in a malloc'd string, or NULL
+ * after setting *error to a malloc'd message.
+ */
+typedef char * (* nixexec_async_fun)(const char * args, char ** error);
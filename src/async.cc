@@ -0,0 +1,155 @@
+#include <cstdlib>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <chrono>
+extern "C" {
+#include <unistd.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <util.hh>
+
+#include "async.hh"
+
+using std::string;
+
+async_job::async_job(nixexec_async_fun fun, string args) :
+  fun(fun), args(std::move(args)), owner(getpid()), done(false),
+  failed(false), abandoned(false) {};
+
+void async_job::run() {
+  char * error = nullptr;
+  char * res = nullptr;
+  try {
+    res = fun(args.c_str(), &error);
+  } catch (...) {
+    /* Plugins are supposed to use the C ABI, but don't take the process
+     * down with them if they don't
+     */
+    res = nullptr;
+  }
+  string().swap(args);
+
+  bool unwanted;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (res) {
+      output = res;
+    } else {
+      failed = true;
+      output = error ? error : "the plugin failed without a message";
+    }
+    done = true;
+    unwanted = abandoned;
+  }
+  free(res);
+  free(error);
+  /* Nobody can be waiting for a job that was released */
+  if (unwanted)
+    delete this;
+  else
+    finished.notify_all();
+}
+
+bool async_job::wait(string & out) {
+  /* A forked child has none of the worker threads, and may have copied the
+   * lock in any state, so it can only see jobs that were already finished.
+   */
+  if (owner != getpid()) {
+    if (!done)
+      throw nix::Error("cannot await a job started before nix-exec forked");
+  } else {
+    /* Woken now and then, so that ^C isn't held up by a slow plugin */
+    std::unique_lock<std::mutex> guard(lock);
+    while (!finished.wait_for(guard, std::chrono::milliseconds(100),
+                              [this] { return done.load(); }))
+      nix::checkInterrupt();
+  }
+  out = output;
+  return !failed;
+}
+
+void async_job::forget_output() {
+  string().swap(output);
+}
+
+void async_job::release() {
+  /* A forked child's copy of an unfinished job will never finish */
+  if (owner != getpid()) {
+    if (done)
+      delete this;
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!done) {
+      abandoned = true;
+      return;
+    }
+  }
+  delete this;
+}
+
+class job_pool {
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<async_job *> queue;
+
+  void work() {
+    while (true) {
+      async_job * job;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this] { return !queue.empty(); });
+        job = queue.front();
+        queue.pop_front();
+      }
+      job->run();
+    }
+  };
+
+  public:
+  job_pool(size_t threads) {
+    while (threads--)
+      std::thread([this] { work(); }).detach();
+  };
+
+  void submit(async_job & job) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queue.push_back(&job);
+    }
+    ready.notify_one();
+  };
+};
+
+static size_t pool_threads() {
+  auto env = getenv("NIX_EXEC_ASYNC_THREADS");
+  if (env) {
+    auto n = atol(env);
+    if (n > 0)
+      return n;
+  }
+  auto n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+/* Started on first use, and again in a forked child, which doesn't have the
+ * parent's threads. The parent's copy is leaked, since it can't be safely
+ * torn down.
+ */
+static job_pool * pool = nullptr;
+static pid_t pool_owner = 0;
+
+void start_job(async_job & job) {
+  if (!pool || pool_owner != getpid()) {
+    pool = new job_pool(pool_threads());
+    pool_owner = getpid();
+  }
+  pool->submit(job);
+}
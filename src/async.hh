@@ -0,0 +1,48 @@
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+extern "C" {
+#include <sys/types.h>
+}
+
+#include "nix-exec.hh"
+
+/* A call of an asynchronous plugin entry point on the worker threads. The
+ * arguments are freed once the plugin has run, and the result once it has
+ * been parsed; the job itself is freed by release.
+ */
+class async_job {
+  nixexec_async_fun fun;
+  std::string args;
+  pid_t owner;
+
+  std::mutex lock;
+  std::condition_variable finished;
+  std::atomic<bool> done;
+  bool failed;
+  bool abandoned;
+  std::string output;
+
+  public:
+  async_job(nixexec_async_fun fun, std::string args);
+
+  /* Called on a worker thread */
+  void run();
+
+  /* Waits for the job. Returns false if it failed, and either way leaves
+   * the result or the error message in output.
+   */
+  bool wait(std::string & output);
+
+  /* Frees the result, once the caller has no more use for it */
+  void forget_output();
+
+  /* Frees the job now if it has finished, or else has the worker thread
+   * free it when it does. Nothing may use the job afterwards.
+   */
+  void release();
+};
+
+/* Queues job on the worker threads, starting them if need be */
+void start_job(async_job & job);
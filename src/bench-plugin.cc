@@ -0,0 +1,15 @@
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <eval.hh>
+
+/* The cheapest possible native function, to measure dlopen overhead */
+extern "C" void nop( nix::EvalState & state
+                   , const nix::Pos & pos
+                   , nix::Value ** args
+                   , nix::Value & v
+                   ) {
+  v.type = nix::tNull;
+}
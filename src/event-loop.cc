@@ -0,0 +1,245 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+}
+
+#include "event-loop.hh"
+
+using boost::format;
+using nix::SysError;
+
+/* One of a process's pipes, or the SIGCHLD pipe if handle is null */
+struct watch {
+  process_handle * handle;
+  nix::AutoCloseFD * fd;
+  bool writing;
+};
+
+static std::vector<process_handle *> processes;
+
+static std::vector<watch *> watches;
+
+static int child_pipe[2] = { -1, -1 };
+
+static void on_sigchld(int) {
+  auto saved = errno;
+  char byte = 0;
+  if (write(child_pipe[1], &byte, 1) == -1) {
+    /* Already a wakeup pending */
+  }
+  errno = saved;
+}
+
+#if HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
+
+static void add_watch(watch * w, int fd) {
+  watches.push_back(w);
+#if HAVE_SYS_EPOLL_H
+  auto ev = epoll_event{};
+  ev.events = w->writing ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = w;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    throw SysError("watching a child's pipe");
+#endif
+}
+
+/* Closes the watched pipe and forgets the watch */
+static void remove_watch(watch * w) {
+#if HAVE_SYS_EPOLL_H
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd->get(), nullptr);
+#endif
+  w->fd->close();
+  watches.erase(std::find(watches.begin(), watches.end(), w));
+  delete w;
+}
+
+/* The process that set the loop up. A forked child (a parallel worker or a
+ * server runner) shares the parent's epoll instance and SIGCHLD pipe, and
+ * the parent's processes aren't its children, so it starts a loop of its
+ * own.
+ */
+static pid_t loop_owner = 0;
+
+/* Run in every forked child straight after fork, so that a child that never
+ * spawns anything doesn't keep the parent's processes' pipes open either,
+ * which would keep a process waiting for the end of its input. Only closes
+ * the descriptors, leaving the epoll registrations, which are shared with
+ * the parent, alone; the watches themselves are freed by forget_loop.
+ */
+static void close_parent_loop() {
+  if (!loop_owner)
+    return;
+#if HAVE_SYS_EPOLL_H
+  close(epoll_fd);
+  epoll_fd = -1;
+#endif
+  for (auto w : watches)
+    close(w->fd->release());
+  close(child_pipe[1]);
+  child_pipe[0] = child_pipe[1] = -1;
+}
+
+/* Drops the parent's loop, whose descriptors close_parent_loop has closed */
+static void forget_loop() {
+  for (auto w : watches)
+    delete w;
+  watches.clear();
+  processes.clear();
+}
+
+static void init_loop() {
+  if (loop_owner == getpid())
+    return;
+  if (loop_owner)
+    forget_loop();
+  else if ((errno = pthread_atfork(nullptr, nullptr, close_parent_loop)))
+    throw SysError("registering fork handler");
+  loop_owner = getpid();
+
+  if (pipe2(child_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    throw SysError("creating pipe");
+#if HAVE_SYS_EPOLL_H
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+    throw SysError("creating epoll instance");
+#endif
+
+  static auto child_fd = nix::AutoCloseFD{};
+  child_fd = child_pipe[0];
+  add_watch(new watch{nullptr, &child_fd, false}, child_pipe[0]);
+
+  struct sigaction act;
+  memset(&act, 0, sizeof act);
+  act.sa_handler = on_sigchld;
+  act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &act, nullptr) == -1)
+    throw SysError("setting SIGCHLD handler");
+}
+
+void watch_process(process_handle & handle) {
+  init_loop();
+  processes.push_back(&handle);
+  if (handle.in) {
+    fcntl(handle.in.get(), F_SETFL, O_NONBLOCK);
+    add_watch(new watch{&handle, &handle.in, true}, handle.in.get());
+  }
+  if (handle.out) {
+    fcntl(handle.out.get(), F_SETFL, O_NONBLOCK);
+    add_watch(new watch{&handle, &handle.out, false}, handle.out.get());
+  }
+  if (handle.err) {
+    fcntl(handle.err.get(), F_SETFL, O_NONBLOCK);
+    add_watch(new watch{&handle, &handle.err, false}, handle.err.get());
+  }
+}
+
+/* Reaps whichever of our processes have exited. Only our own pids are
+ * waited for, so other children of nix-exec are left alone.
+ */
+static void reap() {
+  char buf[64];
+  while (read(child_pipe[0], buf, sizeof buf) > 0);
+  for (auto i = processes.begin(); i != processes.end();) {
+    auto & handle = **i;
+    auto res = waitpid(handle.pid, &handle.status, WNOHANG);
+    if (res == -1 && errno != EINTR)
+      throw SysError(format("waiting for process %1%") % handle.pid);
+    if (res > 0) {
+      handle.exited = true;
+      i = processes.erase(i);
+    } else
+      ++i;
+  }
+}
+
+static void service(watch * w) {
+  if (!w->handle)
+    return reap();
+
+  auto & handle = *w->handle;
+  if (w->writing) {
+    auto res = write( w->fd->get()
+                    , handle.input.data() + handle.written
+                    , handle.input.size() - handle.written
+                    );
+    if (res == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        return;
+      /* The child stopped reading, which is its business */
+      if (errno != EPIPE)
+        throw SysError(format("writing to process %1%") % handle.pid);
+      return remove_watch(w);
+    }
+    handle.written += res;
+    if (handle.written == handle.input.size())
+      remove_watch(w);
+    return;
+  }
+
+  auto & buf = w->fd == &handle.out ? handle.out_buf : handle.err_buf;
+  char chunk[65536];
+  while (true) {
+    auto res = read(w->fd->get(), chunk, sizeof chunk);
+    if (res == -1) {
+      if (errno == EAGAIN)
+        return;
+      if (errno == EINTR)
+        continue;
+      throw SysError(format("reading from process %1%") % handle.pid);
+    }
+    if (res == 0)
+      return remove_watch(w);
+    buf.append(chunk, res);
+  }
+}
+
+void run_event_loop(const std::function<bool()> & done) {
+  init_loop();
+  /* Exits that happened before anyone was waiting */
+  reap();
+
+  while (!done()) {
+    auto ready = std::vector<watch *>{};
+#if HAVE_SYS_EPOLL_H
+    epoll_event events[64];
+    auto count = epoll_wait(epoll_fd, events, 64, -1);
+    if (count == -1) {
+      if (errno != EINTR)
+        throw SysError("waiting for processes");
+      nix::checkInterrupt();
+      continue;
+    }
+    for (int i = 0; i < count; ++i)
+      ready.push_back(static_cast<watch *>(events[i].data.ptr));
+#else
+    auto fds = std::vector<pollfd>{};
+    for (auto w : watches)
+      fds.push_back(pollfd{w->fd->get(), short(w->writing ? POLLOUT : POLLIN), 0});
+    if (poll(fds.data(), fds.size(), -1) == -1) {
+      if (errno != EINTR)
+        throw SysError("waiting for processes");
+      nix::checkInterrupt();
+      continue;
+    }
+    for (size_t i = 0; i < fds.size(); ++i)
+      if (fds[i].revents)
+        ready.push_back(watches[i]);
+#endif
+    for (auto w : ready)
+      service(w);
+  }
+}
@@ -0,0 +1,43 @@
+#include <string>
+#include <functional>
+extern "C" {
+#include <sys/types.h>
+#include <unistd.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <util.hh>
+
+/* A child started with builtins.spawn. Its pipes are non-blocking and are
+ * serviced by the event loop whenever any handle is being waited on, so no
+ * child stalls on a full pipe while the program attends to another.
+ * Handles are never freed, since the evaluator's values referring to them
+ * aren't.
+ */
+struct process_handle {
+  pid_t pid;
+  /* The nix-exec process that spawned it, the only one that can use it */
+  pid_t owner = getpid();
+  bool exited = false;
+  int status = 0;
+
+  nix::AutoCloseFD in;
+  std::string input;
+  size_t written = 0;
+
+  nix::AutoCloseFD out;
+  std::string out_buf;
+
+  nix::AutoCloseFD err;
+  std::string err_buf;
+};
+
+/* Starts servicing handle's pipes and watching for its exit */
+void watch_process(process_handle & handle);
+
+/* Services every watched process until done returns true */
+void run_event_loop(const std::function<bool()> & done);
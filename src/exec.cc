@@ -0,0 +1,232 @@
+#include <csignal>
+extern "C" {
+#include <sys/wait.h>
+}
+
+#include "io.hh"
+#include "nix-exec.hh"
+#include "exec.hh"
+
+#include <eval-inline.hh>
+
+using boost::format;
+using nix::EvalState;
+using nix::Value;
+using nix::Pos;
+using std::string;
+
+Value * spec_attr(EvalState & state, Value & spec, const char * name) {
+  auto i = spec.attrs->find(state.symbols.create(name));
+  return i == spec.attrs->end() ? nullptr : i->value;
+}
+
+spawn_request read_spawn_spec( EvalState & state
+                             , Value & spec
+                             , const Pos & pos
+                             , nix::PathSet & ctx
+                             , string & input
+                             ) {
+  state.forceAttrs(spec, pos);
+  auto req = spawn_request{};
+
+  auto argv = spec_attr(state, spec, "argv");
+  if (!argv)
+    throw nix::EvalError(format("required attribute `argv' missing, at %1%") % pos);
+  state.forceList(*argv, pos);
+  for (size_t i = 0; i < argv->listSize(); ++i)
+    req.argv.push_back(state.coerceToString(pos, *argv->listElems()[i], ctx, false, false));
+
+  auto env = spec_attr(state, spec, "env");
+  if (env) {
+    state.forceAttrs(*env, pos);
+    req.inherit_env = false;
+    for (auto & a : *env->attrs)
+      req.env.push_back(static_cast<const string &>(a.name) + "=" +
+        state.coerceToString(pos, *a.value, ctx, false, false));
+  }
+
+  auto cwd = spec_attr(state, spec, "cwd");
+  if (cwd)
+    req.cwd = state.coerceToString(pos, *cwd, ctx, false, false);
+
+  auto stdin_val = spec_attr(state, spec, "stdin");
+  if (stdin_val) {
+    input = state.coerceToString(pos, *stdin_val, ctx, false, false);
+    req.in = stdio_mode::pipe;
+  }
+
+  return req;
+}
+
+spawned_process start_process( EvalState & state
+                             , const Pos & pos
+                             , const spawn_request & req
+                             , const nix::PathSet & ctx
+                             ) {
+  try {
+    realise_context(state, ctx);
+  } catch (nix::InvalidPathError & e) {
+    throw nix::EvalError(format("cannot run `%1%', since path `%2%' is not valid, at %3%")
+      % req.argv[0] % e.path % pos);
+  }
+
+  try {
+    return spawn(req);
+  } catch (nix::SysError & e) {
+    throw nix::EvalError(format("%1%, at %2%") % e.msg() % pos);
+  }
+}
+
+/* Where one of the child's output streams goes */
+class output_sink {
+  enum class mode { whole, lines, each_line, inherit, discard };
+
+  mode how;
+  Value * fun;
+  string buf;
+  std::vector<string> lines;
+
+  void line(EvalState & state, const Pos & pos, string && l) {
+    if (how == mode::lines) {
+      lines.push_back(std::move(l));
+      return;
+    }
+    auto & arg = *state.allocValue();
+    nix::mkString(arg, l);
+    auto & io = *state.allocValue();
+    state.callFunction(*fun, arg, io, pos);
+    Value res;
+    run_io(state, io, pos, res);
+  };
+
+  public:
+  output_sink(EvalState & state, Value * spec, const Pos & pos) :
+    how(mode::whole), fun(nullptr) {
+    if (!spec)
+      return;
+    state.forceValue(*spec);
+    if (spec->type == nix::tLambda || spec->type == nix::tPrimOp ||
+        spec->type == nix::tPrimOpApp) {
+      how = mode::each_line;
+      fun = spec;
+      return;
+    }
+    auto name = state.forceStringNoCtx(*spec, pos);
+    if (name == "string")
+      how = mode::whole;
+    else if (name == "lines")
+      how = mode::lines;
+    else if (name == "inherit")
+      how = mode::inherit;
+    else if (name == "null")
+      how = mode::discard;
+    else
+      throw nix::EvalError(format("unknown output mode `%1%', at %2%") % name % pos);
+  };
+
+  stdio_mode stdio() const {
+    return how == mode::inherit ? stdio_mode::inherit :
+      how == mode::discard ? stdio_mode::null :
+      stdio_mode::pipe;
+  };
+
+  void feed(EvalState & state, const Pos & pos, const char * data, size_t size) {
+    buf.append(data, size);
+    if (how == mode::whole)
+      return;
+    size_t start = 0;
+    for (auto nl = buf.find('\n'); nl != string::npos; nl = buf.find('\n', start)) {
+      line(state, pos, buf.substr(start, nl - start));
+      start = nl + 1;
+    }
+    buf.erase(0, start);
+  };
+
+  /* Leaves what was captured in v, or null if nothing was */
+  void finish(EvalState & state, const Pos & pos, Value & v) {
+    if (how != mode::whole && !buf.empty())
+      line(state, pos, std::move(buf));
+    switch (how) {
+      case mode::whole:
+        nix::mkString(v, buf);
+        return;
+      case mode::lines:
+        state.mkList(v, lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+          auto & elem = *(v.listElems()[i] = state.allocValue());
+          nix::mkString(elem, lines[i]);
+        }
+        return;
+      default:
+        nix::mkNull(v);
+        return;
+    }
+  };
+};
+
+class exec_value : public effect_value {
+  Value & spec;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.builtins.exec (" << spec << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&spec) == seen.end()) {
+      seen.insert(&spec);
+      res += nix::valueSize(spec);
+    }
+    return res;
+  };
+
+  public:
+  exec_value(Value & spec, const Pos & pos) : spec(spec), pos(pos) {};
+
+  void for_each_value(const std::function<void(Value &)> & f) override {
+    f(spec);
+  };
+
+  const Pos & position() const override {
+    return pos;
+  };
+
+  void perform(EvalState & state, Value & v) override {
+    auto ctx = nix::PathSet{};
+    auto input = string{};
+    auto req = read_spawn_spec(state, spec, pos, ctx, input);
+
+    auto out = output_sink{state, spec_attr(state, spec, "stdout"), pos};
+    auto err = output_sink{state, spec_attr(state, spec, "stderr"), pos};
+    req.out = out.stdio();
+    req.err = err.stdio();
+
+    auto child = start_process(state, pos, req, ctx);
+
+    int status;
+    try {
+      communicate(child, input, [&] (int fd, const char * data, size_t size) {
+        (fd == 1 ? out : err).feed(state, pos, data, size);
+      });
+      status = wait_process(child.pid);
+    } catch (...) {
+      kill(child.pid, SIGTERM);
+      wait_process(child.pid);
+      throw;
+    }
+
+    state.mkAttrs(v, 3);
+    mkInt( *state.allocAttr(v, state.symbols.create("status"))
+         , WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)
+         );
+    out.finish(state, pos, *state.allocAttr(v, state.symbols.create("stdout")));
+    err.finish(state, pos, *state.allocAttr(v, state.symbols.create("stderr")));
+    v.attrs->sort();
+  };
+};
+
+void prim_exec(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW exec_value(*args[0], pos);
+}
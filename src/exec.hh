@@ -0,0 +1,36 @@
+#include <string>
+
+#include "spawn.hh"
+
+namespace nix {
+  class EvalState;
+  struct Value;
+  struct Pos;
+}
+
+/* The attribute name of spec, or null if it has none */
+nix::Value * spec_attr(nix::EvalState & state, nix::Value & spec, const char * name);
+
+/* Reads the argv, env, cwd, and stdin attributes shared by the exec and
+ * spawn specs, collecting their context in ctx and the stdin string in input
+ */
+spawn_request read_spawn_spec( nix::EvalState & state
+                             , nix::Value & spec
+                             , const nix::Pos & pos
+                             , nix::PathSet & ctx
+                             , std::string & input
+                             );
+
+/* Realises ctx and spawns req, reporting failures against pos */
+spawned_process start_process( nix::EvalState & state
+                             , const nix::Pos & pos
+                             , const spawn_request & req
+                             , const nix::PathSet & ctx
+                             );
+
+/* lib.builtins.exec */
+void prim_exec( nix::EvalState & state
+              , const nix::Pos & pos
+              , nix::Value ** args
+              , nix::Value & v
+              );
@@ -0,0 +1,674 @@
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <typeinfo>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <eval.hh>
+#include <hash.hh>
+#include <globals.hh>
+
+#if HAVE_BOEHMGC
+#include <gc/gc_allocator.h>
+#endif
+
+#include "expr-cache.hh"
+
+using nix::Expr;
+using nix::Pos;
+using nix::Symbol;
+using nix::EvalState;
+using std::string;
+
+unsigned long expr_cache_hits = 0;
+unsigned long expr_cache_misses = 0;
+
+static string cache_dir;
+
+/* Bumped whenever the format below changes. Entries are also keyed on the
+ * nix version, since the expression classes are nix's.
+ */
+static const char cache_format[] = "nix-exec parse cache 1";
+
+static const char entry_magic[8] = { 'N', 'X', 'E', 'X', 'A', 'S', 'T', '1' };
+
+/* An entry is the magic, a table of strings, and the expression tree in
+ * preorder. Variable binding information isn't stored; it's recomputed by
+ * bindVars after loading, just as after parsing. Subexpressions the parser
+ * shares (e.g. the source of `inherit (e) a b') are written once and then
+ * referred to by their preorder index.
+ */
+enum expr_tag : uint8_t
+  { tag_null
+  , tag_ref
+  , tag_int
+  , tag_float
+  , tag_string
+  , tag_path
+  , tag_var
+  , tag_select
+  , tag_has_attr
+  , tag_attrs
+  , tag_list
+  , tag_lambda
+  , tag_let
+  , tag_with
+  , tag_if
+  , tag_assert
+  , tag_not
+  , tag_app
+  , tag_eq
+  , tag_neq
+  , tag_and
+  , tag_or
+  , tag_impl
+  , tag_update
+  , tag_concat_lists
+  , tag_concat_strings
+  , tag_pos
+  };
+
+static const uint32_t no_string = UINT32_MAX;
+
+/* Thrown for expressions the format doesn't know, which are then just not
+ * cached.
+ */
+struct unsupported_expr {};
+
+/* Thrown for entries that can't be read, which are then replaced */
+struct bad_entry {};
+
+class expr_writer {
+  string strings;
+  uint32_t string_count = 0;
+  std::unordered_map<string, uint32_t> string_ids;
+  string nodes;
+  std::unordered_map<const Expr *, uint32_t> node_ids;
+
+  template <typename T> void raw(string & out, const T & t) {
+    out.append(reinterpret_cast<const char *>(&t), sizeof t);
+  }
+
+  void u8(uint8_t n) { raw(nodes, n); }
+
+  void u32(uint32_t n) { raw(nodes, n); }
+
+  void str(const string & s) {
+    auto i = string_ids.find(s);
+    if (i == string_ids.end()) {
+      i = string_ids.emplace(s, string_count++).first;
+      raw(strings, uint32_t(s.size()));
+      strings.append(s);
+    }
+    u32(i->second);
+  }
+
+  void sym(const Symbol & s) {
+    if (s.set())
+      str(s);
+    else
+      u32(no_string);
+  }
+
+  void pos(const Pos & p) {
+    sym(p.file);
+    u32(p.line);
+    u32(p.column);
+  }
+
+  void attr_path(const nix::AttrPath & path) {
+    u32(path.size());
+    for (auto & name : path) {
+      u8(name.symbol.set());
+      if (name.symbol.set())
+        sym(name.symbol);
+      else
+        expr(name.expr);
+    }
+  }
+
+  template <typename T> bool binop(const Expr * e, expr_tag tag) {
+    if (typeid(*e) != typeid(T))
+      return false;
+    auto & op = static_cast<const T &>(*e);
+    u8(tag);
+    pos(op.pos);
+    expr(op.e1);
+    expr(op.e2);
+    return true;
+  }
+
+public:
+  void expr(const Expr * e) {
+    if (!e) {
+      u8(tag_null);
+      return;
+    }
+
+    auto seen = node_ids.find(e);
+    if (seen != node_ids.end()) {
+      u8(tag_ref);
+      u32(seen->second);
+      return;
+    }
+    auto id = node_ids.size();
+    node_ids.emplace(e, id);
+
+    auto & type = typeid(*e);
+    if (type == typeid(nix::ExprInt)) {
+      u8(tag_int);
+      raw(nodes, int64_t(static_cast<const nix::ExprInt *>(e)->n));
+    } else if (type == typeid(nix::ExprFloat)) {
+      u8(tag_float);
+      raw(nodes, static_cast<const nix::ExprFloat *>(e)->nf);
+    } else if (type == typeid(nix::ExprString)) {
+      u8(tag_string);
+      sym(static_cast<const nix::ExprString *>(e)->s);
+    } else if (type == typeid(nix::ExprPath)) {
+      u8(tag_path);
+      str(static_cast<const nix::ExprPath *>(e)->s);
+    } else if (type == typeid(nix::ExprVar)) {
+      auto & var = static_cast<const nix::ExprVar &>(*e);
+      u8(tag_var);
+      pos(var.pos);
+      sym(var.name);
+    } else if (type == typeid(nix::ExprSelect)) {
+      auto & sel = static_cast<const nix::ExprSelect &>(*e);
+      u8(tag_select);
+      pos(sel.pos);
+      expr(sel.e);
+      attr_path(sel.attrPath);
+      expr(sel.def);
+    } else if (type == typeid(nix::ExprOpHasAttr)) {
+      auto & has = static_cast<const nix::ExprOpHasAttr &>(*e);
+      u8(tag_has_attr);
+      expr(has.e);
+      attr_path(has.attrPath);
+    } else if (type == typeid(nix::ExprAttrs)) {
+      auto & attrs = static_cast<const nix::ExprAttrs &>(*e);
+      u8(tag_attrs);
+      u8(attrs.recursive);
+      u32(attrs.attrs.size());
+      for (auto & attr : attrs.attrs) {
+        sym(attr.first);
+        u8(attr.second.inherited);
+        pos(attr.second.pos);
+        expr(attr.second.e);
+      }
+      u32(attrs.dynamicAttrs.size());
+      for (auto & attr : attrs.dynamicAttrs) {
+        pos(attr.pos);
+        expr(attr.nameExpr);
+        expr(attr.valueExpr);
+      }
+    } else if (type == typeid(nix::ExprList)) {
+      auto & list = static_cast<const nix::ExprList &>(*e);
+      u8(tag_list);
+      u32(list.elems.size());
+      for (auto elem : list.elems)
+        expr(elem);
+    } else if (type == typeid(nix::ExprLambda)) {
+      auto & fun = static_cast<const nix::ExprLambda &>(*e);
+      u8(tag_lambda);
+      pos(fun.pos);
+      sym(fun.name);
+      sym(fun.arg);
+      u8(fun.matchAttrs);
+      if (fun.matchAttrs) {
+        u8(fun.formals->ellipsis);
+        u32(fun.formals->formals.size());
+        for (auto & formal : fun.formals->formals) {
+          sym(formal.name);
+          expr(formal.def);
+        }
+      }
+      expr(fun.body);
+    } else if (type == typeid(nix::ExprLet)) {
+      auto & let = static_cast<const nix::ExprLet &>(*e);
+      u8(tag_let);
+      expr(let.attrs);
+      expr(let.body);
+    } else if (type == typeid(nix::ExprWith)) {
+      auto & with = static_cast<const nix::ExprWith &>(*e);
+      u8(tag_with);
+      pos(with.pos);
+      expr(with.attrs);
+      expr(with.body);
+    } else if (type == typeid(nix::ExprIf)) {
+      auto & cond = static_cast<const nix::ExprIf &>(*e);
+      u8(tag_if);
+      expr(cond.cond);
+      expr(cond.then);
+      expr(cond.else_);
+    } else if (type == typeid(nix::ExprAssert)) {
+      auto & assertion = static_cast<const nix::ExprAssert &>(*e);
+      u8(tag_assert);
+      pos(assertion.pos);
+      expr(assertion.cond);
+      expr(assertion.body);
+    } else if (type == typeid(nix::ExprOpNot)) {
+      u8(tag_not);
+      expr(static_cast<const nix::ExprOpNot *>(e)->e);
+    } else if (type == typeid(nix::ExprConcatStrings)) {
+      auto & concat = static_cast<const nix::ExprConcatStrings &>(*e);
+      u8(tag_concat_strings);
+      pos(concat.pos);
+      u8(concat.forceString);
+      u32(concat.es->size());
+      for (auto elem : *concat.es)
+        expr(elem);
+    } else if (type == typeid(nix::ExprPos)) {
+      u8(tag_pos);
+      pos(static_cast<const nix::ExprPos *>(e)->pos);
+    } else if (!( binop<nix::ExprApp>(e, tag_app)
+               || binop<nix::ExprOpEq>(e, tag_eq)
+               || binop<nix::ExprOpNEq>(e, tag_neq)
+               || binop<nix::ExprOpAnd>(e, tag_and)
+               || binop<nix::ExprOpOr>(e, tag_or)
+               || binop<nix::ExprOpImpl>(e, tag_impl)
+               || binop<nix::ExprOpUpdate>(e, tag_update)
+               || binop<nix::ExprOpConcatLists>(e, tag_concat_lists)
+               )) {
+      throw unsupported_expr{};
+    }
+  }
+
+  string finish() {
+    auto res = string(entry_magic, sizeof entry_magic);
+    raw(res, string_count);
+    res.append(strings);
+    res.append(nodes);
+    return res;
+  }
+};
+
+class expr_reader {
+  EvalState & state;
+  const char * p;
+  const char * end;
+  std::vector<string> strings;
+  std::vector<Symbol> symbols;
+  std::vector<Expr *> nodes;
+
+  template <typename T> T raw() {
+    if (size_t(end - p) < sizeof(T))
+      throw bad_entry{};
+    T t;
+    memcpy(&t, p, sizeof t);
+    p += sizeof t;
+    return t;
+  }
+
+  uint8_t u8() { return raw<uint8_t>(); }
+
+  uint32_t u32() { return raw<uint32_t>(); }
+
+  const string & str() {
+    auto id = u32();
+    if (id >= strings.size())
+      throw bad_entry{};
+    return strings[id];
+  }
+
+  Symbol sym() {
+    auto id = u32();
+    if (id == no_string)
+      return Symbol{};
+    if (id >= strings.size())
+      throw bad_entry{};
+    if (!symbols[id].set())
+      symbols[id] = state.symbols.create(strings[id]);
+    return symbols[id];
+  }
+
+  Pos pos() {
+    auto file = sym();
+    auto line = u32();
+    auto column = u32();
+    return Pos{file, line, column};
+  }
+
+  nix::AttrPath attr_path() {
+    auto path = nix::AttrPath{};
+    auto count = u32();
+    while (count--) {
+      if (u8())
+        path.emplace_back(sym());
+      else
+        path.emplace_back(expr());
+    }
+    return path;
+  }
+
+  template <typename T> Expr * binop() {
+    auto p = pos();
+    auto e1 = expr();
+    auto e2 = expr();
+    return new T(p, e1, e2);
+  }
+
+  Expr * node(expr_tag tag) {
+    switch (tag) {
+      case tag_int:
+        return new nix::ExprInt(raw<int64_t>());
+      case tag_float:
+        return new nix::ExprFloat(raw<nix::NixFloat>());
+      case tag_string:
+        return new nix::ExprString(sym());
+      case tag_path:
+        return new nix::ExprPath(str());
+      case tag_var: {
+        auto p = pos();
+        return new nix::ExprVar(p, sym());
+      }
+      case tag_select: {
+        auto p = pos();
+        auto e = expr();
+        auto path = attr_path();
+        return new nix::ExprSelect(p, e, path, expr());
+      }
+      case tag_has_attr: {
+        auto e = expr();
+        return new nix::ExprOpHasAttr(e, attr_path());
+      }
+      case tag_attrs: {
+        auto attrs = new nix::ExprAttrs;
+        attrs->recursive = u8();
+        auto count = u32();
+        while (count--) {
+          auto name = sym();
+          auto inherited = u8();
+          auto p = pos();
+          attrs->attrs[name] = nix::ExprAttrs::AttrDef(expr(), p, inherited);
+        }
+        count = u32();
+        while (count--) {
+          auto p = pos();
+          auto name = expr();
+          auto value = expr();
+          attrs->dynamicAttrs.emplace_back(name, value, p);
+        }
+        return attrs;
+      }
+      case tag_list: {
+        auto list = new nix::ExprList;
+        auto count = u32();
+        while (count--)
+          list->elems.push_back(expr());
+        return list;
+      }
+      case tag_lambda: {
+        auto p = pos();
+        auto name = sym();
+        auto arg = sym();
+        auto match_attrs = bool(u8());
+        nix::Formals * formals = nullptr;
+        if (match_attrs) {
+          formals = new nix::Formals;
+          formals->ellipsis = u8();
+          auto count = u32();
+          while (count--) {
+            auto formal = sym();
+            formals->formals.emplace_back(formal, expr());
+            formals->argNames.insert(formal);
+          }
+        }
+        auto fun = new nix::ExprLambda(p, arg, match_attrs, formals, expr());
+        if (name.set())
+          fun->setName(name);
+        return fun;
+      }
+      case tag_let: {
+        auto attrs = dynamic_cast<nix::ExprAttrs *>(expr());
+        if (!attrs)
+          throw bad_entry{};
+        return new nix::ExprLet(attrs, expr());
+      }
+      case tag_with: {
+        auto p = pos();
+        auto attrs = expr();
+        return new nix::ExprWith(p, attrs, expr());
+      }
+      case tag_if: {
+        auto cond = expr();
+        auto then = expr();
+        return new nix::ExprIf(cond, then, expr());
+      }
+      case tag_assert: {
+        auto p = pos();
+        auto cond = expr();
+        return new nix::ExprAssert(p, cond, expr());
+      }
+      case tag_not:
+        return new nix::ExprOpNot(expr());
+      case tag_app:
+        return binop<nix::ExprApp>();
+      case tag_eq:
+        return binop<nix::ExprOpEq>();
+      case tag_neq:
+        return binop<nix::ExprOpNEq>();
+      case tag_and:
+        return binop<nix::ExprOpAnd>();
+      case tag_or:
+        return binop<nix::ExprOpOr>();
+      case tag_impl:
+        return binop<nix::ExprOpImpl>();
+      case tag_update:
+        return binop<nix::ExprOpUpdate>();
+      case tag_concat_lists:
+        return binop<nix::ExprOpConcatLists>();
+      case tag_concat_strings: {
+        auto p = pos();
+        auto force_string = bool(u8());
+        auto es = new std::vector<Expr *>;
+        auto count = u32();
+        while (count--)
+          es->push_back(expr());
+        return new nix::ExprConcatStrings(p, force_string, es);
+      }
+      case tag_pos:
+        return new nix::ExprPos(pos());
+      default:
+        throw bad_entry{};
+    }
+  }
+
+  Expr * expr() {
+    auto tag = expr_tag(u8());
+    if (tag == tag_null)
+      return nullptr;
+    if (tag == tag_ref) {
+      auto id = u32();
+      if (id >= nodes.size() || !nodes[id])
+        throw bad_entry{};
+      return nodes[id];
+    }
+
+    /* Reserve our preorder index before reading the children */
+    auto id = nodes.size();
+    nodes.push_back(nullptr);
+    auto e = node(tag);
+    nodes[id] = e;
+    return e;
+  }
+
+public:
+  expr_reader(EvalState & state, const char * data, size_t size) :
+    state(state), p(data), end(data + size) {};
+
+  Expr * read() {
+    if (size_t(end - p) < sizeof entry_magic ||
+        memcmp(p, entry_magic, sizeof entry_magic) != 0)
+      throw bad_entry{};
+    p += sizeof entry_magic;
+
+    auto count = u32();
+    while (count--) {
+      auto len = u32();
+      if (size_t(end - p) < len)
+        throw bad_entry{};
+      strings.emplace_back(p, len);
+      p += len;
+    }
+    symbols.resize(strings.size());
+
+    auto e = expr();
+    if (!e || p != end)
+      throw bad_entry{};
+    return e;
+  }
+};
+
+static Expr * load_entry(EvalState & state, const string & entry) {
+  auto fd = nix::AutoCloseFD{open(entry.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd.get() == -1)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1 || st.st_size == 0)
+    return nullptr;
+
+  auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if (data == MAP_FAILED)
+    return nullptr;
+
+  Expr * e = nullptr;
+  try {
+    e = expr_reader{state, static_cast<const char *>(data), size_t(st.st_size)}.read();
+  } catch (bad_entry &) {
+  }
+  munmap(data, st.st_size);
+
+  if (e)
+    e->bindVars(state.staticBaseEnv);
+  return e;
+}
+
+static void store_entry(const string & entry, const Expr * e) {
+  auto writer = expr_writer{};
+  try {
+    writer.expr(e);
+  } catch (unsupported_expr &) {
+    return;
+  }
+
+  /* Write then rename, so concurrent runs never see half an entry */
+  auto tmp = entry + ".tmp." + std::to_string(getpid());
+  try {
+    nix::writeFile(tmp, writer.finish());
+  } catch (nix::SysError &) {
+    unlink(tmp.c_str());
+    return;
+  }
+  if (rename(tmp.c_str(), entry.c_str()) == -1)
+    unlink(tmp.c_str());
+}
+
+Expr * parse_file(EvalState & state, const string & path) {
+  if (cache_dir.empty())
+    return state.parseExprFromFile(path);
+
+  /* Entries are keyed on the path too, since relative paths in the file are
+   * resolved at parse time.
+   */
+  auto key = string(cache_format) + '\0' + nix::nixVersion + '\0' +
+    path + '\0' + nix::readFile(path);
+  auto entry = cache_dir + "/" +
+    nix::printHash32(nix::hashString(nix::htSHA256, key));
+
+  auto e = load_entry(state, entry);
+  if (e) {
+    ++expr_cache_hits;
+    return e;
+  }
+
+  ++expr_cache_misses;
+  e = state.parseExprFromFile(path);
+  store_entry(entry, e);
+  return e;
+}
+
+/* Files imported while the cache is open, like nix's own evalFile cache */
+#if HAVE_BOEHMGC
+typedef std::map< nix::Path
+                , nix::Value
+                , std::less<nix::Path>
+                , traceable_allocator<std::pair<const nix::Path, nix::Value>>
+                > import_cache;
+#else
+typedef std::map<nix::Path, nix::Value> import_cache;
+#endif
+
+static import_cache imported;
+
+static nix::Value original_import;
+
+static void cached_import( EvalState & state
+                         , const Pos & pos
+                         , nix::Value ** args
+                         , nix::Value & v
+                         ) {
+  auto context = nix::PathSet{};
+  auto path = state.coerceToPath(pos, *args[0], context);
+
+  /* Leave anything that needs building to nix */
+  if (!context.empty() || nix::hasSuffix(path, ".drv")) {
+    state.callFunction(original_import, *args[0], v, pos);
+    return;
+  }
+
+  /* The same checks as nix's import, so restricted mode still applies */
+  path = state.checkSourcePath(nix::resolveExprPath(state.checkSourcePath(path)));
+  auto cached = imported.find(path);
+  if (cached != imported.end()) {
+    v = cached->second;
+    return;
+  }
+
+  /* Only the parse is ours to cache; without a cache dir, nix does it all */
+  if (cache_dir.empty())
+    state.callFunction(original_import, *args[0], v, pos);
+  else
+    state.eval(parse_file(state, path), v);
+  imported[path] = v;
+}
+
+void track_imports(EvalState & state) {
+  static auto tracking = false;
+  if (tracking)
+    return;
+
+  auto var = state.staticBaseEnv.vars.find(state.symbols.create("import"));
+  if (var == state.staticBaseEnv.vars.end())
+    return;
+
+  /* builtins.import is the same value, so this replaces both */
+  auto & import = *state.baseEnv.values[var->second];
+  original_import = import;
+  import.type = nix::tPrimOp;
+  import.primOp = new nix::PrimOp(cached_import, 1, state.symbols.create("import"));
+  tracking = true;
+}
+
+void for_each_import(const std::function<void(const string &)> & f) {
+  for (auto & i : imported)
+    f(i.first);
+}
+
+void expr_cache_open(EvalState & state, const string & dir) {
+  nix::createDirs(dir);
+  cache_dir = dir;
+  track_imports(state);
+}
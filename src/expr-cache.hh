@@ -0,0 +1,27 @@
+#include <string>
+#include <functional>
+
+namespace nix {
+  class EvalState;
+  struct Expr;
+}
+
+/* The number of parses answered from and missing the on-disk cache */
+extern unsigned long expr_cache_hits;
+extern unsigned long expr_cache_misses;
+
+/* Keeps parsed expressions in dir from now on, for both parse_file and the
+ * files the program imports.
+ */
+void expr_cache_open(nix::EvalState & state, const std::string & dir);
+
+/* Like state.parseExprFromFile, but uses the cache if it's been opened */
+nix::Expr * parse_file(nix::EvalState & state, const std::string & path);
+
+/* Makes `import' go through parse_file and remember the files it imported,
+ * whether or not the cache has been opened.
+ */
+void track_imports(nix::EvalState & state);
+
+/* Calls f with each file imported since track_imports */
+void for_each_import(const std::function<void(const std::string &)> & f);
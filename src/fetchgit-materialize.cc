@@ -0,0 +1,324 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <shared.hh>
+
+#include "spawn.hh"
+
+/* Checks a commit's tree out of a bare repo for fetchgit.sh, and seals the
+ * result into the archive cache.
+ *
+ *   fetchgit-materialize GIT_DIR REV DIR
+ *
+ * writes the tree of REV into the existing directory DIR. Files are created
+ * read-only (0444, or 0555 if executable), several at a time; directories are
+ * left writable so submodules can be added. Submodules become empty
+ * directories, as with git archive.
+ *
+ *   fetchgit-materialize --seal DIR ARCHIVE
+ *
+ * makes everything under DIR read-only, writes it back to disk, and renames
+ * DIR to ARCHIVE. Unlike sync, this only writes back the cache's filesystem
+ * (or, without syncfs, just the archive).
+ */
+
+using boost::format;
+using nix::SysError;
+using nix::Error;
+using std::string;
+
+static void check_status(const string & what, int status) {
+  if (!WIFEXITED(status))
+    throw Error(format("%1% killed by signal %2%") % what % strsignal(WTERMSIG(status)));
+  if (WEXITSTATUS(status))
+    throw Error(format("%1% exited with non-zero exit code %2%") % what
+      % WEXITSTATUS(status));
+}
+
+static size_t worker_count(size_t count) {
+  return std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), count);
+}
+
+/* Runs f(t, i) for every i < count, spread over worker_count(count) threads,
+ * t being the thread's index
+ */
+template <typename F> static void parallel_for(size_t count, F f) {
+  auto threads = worker_count(count);
+  auto errors = std::vector<std::exception_ptr>(threads);
+  auto workers = std::vector<std::thread>{};
+  for (size_t t = 0; t < threads; ++t)
+    workers.emplace_back([&, t] {
+      try {
+        for (auto i = t; i < count; i += threads)
+          f(t, i);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  for (auto & w : workers)
+    w.join();
+  for (auto & e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
+
+static void fsync_path(const string & path, int flags) {
+  nix::AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | flags);
+  if (!fd)
+    throw SysError(format("opening `%1%'") % path);
+  if (fsync(fd.get()) == -1)
+    throw SysError(format("syncing `%1%'") % path);
+}
+
+struct tree_entry {
+  unsigned mode;
+  string oid;
+  string path;
+};
+
+static std::vector<tree_entry> list_tree(const string & git_dir, const string & rev) {
+  auto req = spawn_request{};
+  req.argv = { NIXEXEC_GIT, "--git-dir=" + git_dir, "ls-tree", "-r", "-t", "-z"
+             , "--full-tree", rev
+             };
+  req.out = stdio_mode::pipe;
+  auto child = spawn(req);
+  auto listing = string{};
+  communicate(child, "", [&] (int, const char * data, size_t size) {
+    listing.append(data, size);
+  });
+  check_status("git ls-tree", wait_process(child.pid));
+
+  /* <mode> SP <type> SP <oid> TAB <path> NUL */
+  auto entries = std::vector<tree_entry>{};
+  size_t start = 0;
+  for (auto end = listing.find('\0'); end != string::npos;
+       start = end + 1, end = listing.find('\0', start)) {
+    auto line = listing.substr(start, end - start);
+    auto tab = line.find('\t');
+    auto sp1 = line.find(' ');
+    auto sp2 = line.find(' ', sp1 + 1);
+    if (tab == string::npos || sp1 == string::npos || sp2 == string::npos)
+      throw Error(format("unexpected git ls-tree output `%1%'") % line);
+    entries.push_back(tree_entry{ unsigned(std::stoul(line.substr(0, sp1), nullptr, 8))
+                                , line.substr(sp2 + 1, tab - sp2 - 1)
+                                , line.substr(tab + 1)
+                                });
+  }
+  return entries;
+}
+
+/* A git cat-file --batch process, asked for one blob at a time */
+class blob_reader {
+  spawned_process proc;
+  FILE * out;
+
+  public:
+  blob_reader(const string & git_dir) {
+    auto req = spawn_request{};
+    req.argv = { NIXEXEC_GIT, "--git-dir=" + git_dir, "cat-file", "--batch" };
+    req.in = stdio_mode::pipe;
+    req.out = stdio_mode::pipe;
+    proc = spawn(req);
+    out = fdopen(proc.out.get(), "r");
+    if (!out)
+      throw SysError("opening git cat-file's output");
+    proc.out.release();
+  };
+
+  blob_reader(const blob_reader &) = delete;
+
+  ~blob_reader() {
+    proc.in.close();
+    fclose(out);
+    try {
+      wait_process(proc.pid);
+    } catch (SysError &) {
+    }
+  };
+
+  /* Asks for a blob and returns its size, after which it must be read */
+  size_t request(const string & oid) {
+    auto line = oid + "\n";
+    nix::writeFull(proc.in.get(), line);
+    char header[256];
+    if (!fgets(header, sizeof header, out))
+      throw Error(format("git cat-file exited while reading `%1%'") % oid);
+    char type[32];
+    unsigned long long size;
+    if (sscanf(header, "%*s %31s %llu", type, &size) != 2 || strcmp(type, "blob"))
+      throw Error(format("`%1%' is not a blob in the repo") % oid);
+    return size;
+  };
+
+  /* Hands the requested blob to sink in chunks */
+  template <typename Sink> void read(size_t size, Sink sink) {
+    char buf[65536];
+    while (size) {
+      auto n = fread(buf, 1, std::min(size, sizeof buf), out);
+      if (n == 0)
+        throw Error("git cat-file output ended early");
+      sink(buf, n);
+      size -= n;
+    }
+    if (fgetc(out) != '\n')
+      throw Error("unexpected git cat-file output");
+  };
+};
+
+static void materialize(const string & git_dir, const string & rev, const string & dir) {
+  auto entries = list_tree(git_dir, rev);
+
+  /* Trees come before their contents */
+  auto blobs = std::vector<const tree_entry *>{};
+  for (auto & e : entries) {
+    auto path = dir + "/" + e.path;
+    switch (e.mode & S_IFMT) {
+      case S_IFDIR:
+      /* Submodules (gitlinks) */
+      case S_IFDIR | S_IFLNK:
+        if (mkdir(path.c_str(), 0755) == -1)
+          throw SysError(format("creating directory `%1%'") % path);
+        break;
+      default:
+        blobs.push_back(&e);
+    }
+  }
+
+  auto readers = std::vector<std::unique_ptr<blob_reader>>{};
+  for (size_t t = 0; t < worker_count(blobs.size()); ++t)
+    readers.emplace_back(new blob_reader(git_dir));
+
+  parallel_for(blobs.size(), [&] (size_t t, size_t i) {
+    auto & e = *blobs[i];
+    auto path = dir + "/" + e.path;
+    auto & reader = *readers[t];
+    auto size = reader.request(e.oid);
+
+    if ((e.mode & S_IFMT) == S_IFLNK) {
+      auto target = string{};
+      reader.read(size, [&] (const char * data, size_t n) {
+        target.append(data, n);
+      });
+      if (symlink(target.c_str(), path.c_str()) == -1)
+        throw SysError(format("creating symlink `%1%'") % path);
+      return;
+    }
+
+    auto perms = e.mode & 0100 ? 0555 : 0444;
+    nix::AutoCloseFD fd = open( path.c_str()
+                              , O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC
+                              , perms
+                              );
+    if (!fd)
+      throw SysError(format("creating `%1%'") % path);
+    reader.read(size, [&] (const char * data, size_t n) {
+      nix::writeFull(fd.get(), reinterpret_cast<const unsigned char *>(data), n);
+    });
+  });
+}
+
+static void walk( const string & path
+                , std::vector<string> & files
+                , std::vector<string> & dirs
+                ) {
+  auto dir = opendir(path.c_str());
+  if (!dir)
+    throw SysError(format("opening directory `%1%'") % path);
+  struct dirent * ent;
+  while ((errno = 0, ent = readdir(dir))) {
+    auto name = string{ent->d_name};
+    if (name == "." || name == "..")
+      continue;
+    auto child = path + "/" + name;
+    struct stat st;
+    if (lstat(child.c_str(), &st) == -1) {
+      closedir(dir);
+      throw SysError(format("getting status of `%1%'") % child);
+    }
+    if (S_ISDIR(st.st_mode))
+      walk(child, files, dirs);
+    else if (S_ISREG(st.st_mode))
+      files.push_back(child);
+  }
+  auto err = errno;
+  closedir(dir);
+  if (err) {
+    errno = err;
+    throw SysError(format("reading directory `%1%'") % path);
+  }
+  /* After its contents, so they can still be changed */
+  dirs.push_back(path);
+}
+
+static void seal(const string & dir, const string & archive) {
+  auto files = std::vector<string>{};
+  auto dirs = std::vector<string>{};
+  walk(dir, files, dirs);
+
+  /* Everything is written before anything is flushed, so the filesystem can
+   * write it all back in one go
+   */
+  parallel_for(files.size(), [&] (size_t, size_t i) {
+    struct stat st;
+    if (stat(files[i].c_str(), &st) == -1)
+      throw SysError(format("getting status of `%1%'") % files[i]);
+    if (st.st_mode & 0222 && chmod(files[i].c_str(), st.st_mode & 07555) == -1)
+      throw SysError(format("changing mode of `%1%'") % files[i]);
+  });
+
+  for (auto & d : dirs)
+    if (chmod(d.c_str(), 0555) == -1)
+      throw SysError(format("changing mode of `%1%'") % d);
+
+#if HAVE_SYNCFS
+  nix::AutoCloseFD fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (!fd)
+    throw SysError(format("opening `%1%'") % dir);
+  if (syncfs(fd.get()) == -1)
+    throw SysError(format("syncing the filesystem of `%1%'") % dir);
+#else
+  parallel_for(files.size(), [&] (size_t, size_t i) {
+    fsync_path(files[i], 0);
+  });
+  parallel_for(dirs.size(), [&] (size_t, size_t i) {
+    fsync_path(dirs[i], O_DIRECTORY);
+  });
+#endif
+
+  if (rename(dir.c_str(), archive.c_str()) == -1)
+    throw SysError(format("renaming `%1%' to `%2%'") % dir % archive);
+  fsync_path(nix::dirOf(archive), O_DIRECTORY);
+}
+
+int main(int argc, char ** argv) {
+  return nix::handleExceptions(argv[0], [&] {
+    auto args = std::vector<string>(argv + 1, argv + argc);
+    if (args.size() == 3 && args[0] == "--seal")
+      seal(args[1], args[2]);
+    else if (args.size() == 3)
+      materialize(args[0], args[1], args[2]);
+    else
+      throw nix::UsageError(format("usage: %1% GIT_DIR REV DIR | --seal DIR ARCHIVE")
+        % argv[0]);
+  });
+}
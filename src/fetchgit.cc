@@ -2,9 +2,10 @@
 #include <cstring>
 extern "C" {
 #include <unistd.h>
-#include <err.h>
 #include <pwd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <nix-exec.h>
 }
 
 /* Work around nix's config.h */
@@ -16,6 +17,8 @@ extern "C" {
 #include <eval-inline.hh>
 #include <util.hh>
 
+#include <spawn.hh>
+
 using boost::format;
 using nix::EvalError;
 using nix::SysError;
@@ -37,6 +40,29 @@ static Path get_default_cache_dir() {
   return home ? Path{home} + "/.cache/fetchgit" : "/var/lib/empty/.cache/fetchgit";
 }
 
+static bool is_full_rev(const std::string & rev) {
+  return rev.size() == 40 &&
+    rev.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+/* Where fetchgit.sh puts the archive of a given commit. v2 archives are
+ * written by fetchgit-materialize, which doesn't apply export-ignore or
+ * export-subst the way git archive did, so they're kept apart.
+ */
+static Path archive_path( const Path & cache_dir
+                        , const std::string & url
+                        , const std::string & rev
+                        , bool do_submodules
+                        ) {
+  auto end = url.find_last_not_of('/');
+  auto trimmed = end == std::string::npos ? url : url.substr(0, end + 1);
+  auto base = nix::baseNameOf(trimmed);
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".git") == 0)
+    base.resize(base.size() - 4);
+  return cache_dir + "/archives/v2/" + base + "/" +
+    (do_submodules ? "true" : "false") + "/" + rev + "/" + base;
+}
+
 extern "C" void fetchgit( nix::EvalState & state
                         , const nix::Pos & pos
                         , Value ** args
@@ -48,6 +74,9 @@ extern "C" void fetchgit( nix::EvalState & state
   auto url_sym = state.symbols.create("url");
   auto rev_sym = state.symbols.create("rev");
   auto submodules_sym = state.symbols.create("fetchSubmodules");
+  auto upstream_sym = state.symbols.create("upstream");
+  auto depth_sym = state.symbols.create("depth");
+  auto filter_sym = state.symbols.create("filter");
 
   state.forceAttrs(*args[0]);
 
@@ -80,37 +109,68 @@ extern "C" void fetchgit( nix::EvalState & state
     true :
     state.forceBool(*submodules_iter->value, *submodules_iter->pos);
 
-  constexpr char fetchgit_path[] = NIXEXEC_LIBEXEC_DIR "/fetchgit.sh";
-  const char * const argv[] = { fetchgit_path
-                              , cache_dir.c_str()
-                              , url.c_str()
-                              , rev.c_str()
-                              , do_submodules ? "true" : "false"
-                              , nullptr
-                              };
-  auto pipe = nix::Pipe();
-  pipe.create();
-
-  auto child = fork();
-  switch (child) {
-    case -1:
-      throw SysError("forking to run fetchgit");
-    case 0:
-      pipe.readSide = -1;
-      if (dup2(pipe.writeSide.get(), STDOUT_FILENO) == -1)
-        err(214, "duping pipe to stdout");
-      /* const-correct, execv doesn't modify it c just has dumb casting rules */
-      execv(fetchgit_path, const_cast<char * const *>(argv));
-      err(212, "executing %s", fetchgit_path);
+  auto upstream_iter = args[0]->attrs->find(upstream_sym);
+  auto upstream = std::string{};
+  if (upstream_iter != args[0]->attrs->end()) {
+    upstream = state.coerceToString( *upstream_iter->pos
+                                   , *upstream_iter->value
+                                   , context
+                                   , false
+                                   , false
+                                   );
+    if (!context.empty())
+      throw EvalError(format(
+        "the upstream url is not allowed to refer to a store path (such as `%1%'), at %2%"
+      ) % *context.begin() % *upstream_iter->pos);
+  }
+
+  auto depth_iter = args[0]->attrs->find(depth_sym);
+  auto depth = std::string{};
+  if (depth_iter != args[0]->attrs->end()) {
+    auto n = state.forceInt(*depth_iter->value, *depth_iter->pos);
+    if (n <= 0)
+      throw EvalError(format("the depth must be positive, at %1%") % *depth_iter->pos);
+    depth = std::to_string(n);
+  }
+
+  auto filter_iter = args[0]->attrs->find(filter_sym);
+  auto filter = filter_iter == args[0]->attrs->end() ?
+    std::string{} :
+    state.forceStringNoCtx(*filter_iter->value, *filter_iter->pos);
+
+  /* Only a full commit id says which archive will be used without asking git.
+   * Archives are moved into place whole, so if it's there it's complete.
+   */
+  if (is_full_rev(rev)) {
+    auto archive = archive_path(cache_dir, url, rev, do_submodules);
+    struct stat st;
+    if (stat(archive.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      ++nixexec_fetchgit_cache_hits;
+      nix::mkPath(v, archive.c_str());
+      return;
+    }
   }
-  pipe.writeSide = -1;
-  auto path = nix::drainFD(pipe.readSide.get());
-
-  int status;
-  errno = 0;
-  while (waitpid(child, &status, 0) == -1 && errno == EINTR);
-  if (errno && errno != EINTR)
-    throw SysError("waiting for fetchgit");
+  ++nixexec_fetchgit_cache_misses;
+
+  auto req = spawn_request{};
+  req.argv = { NIXEXEC_LIBEXEC_DIR "/fetchgit.sh"
+             , cache_dir
+             , url
+             , rev
+             , do_submodules ? "true" : "false"
+             , upstream
+             , depth
+             , filter
+             };
+  req.out = stdio_mode::pipe;
+  auto child = spawn(req);
+
+  auto path = std::string{};
+  communicate(child, "", [&] (int, const char * data, size_t size) {
+    path.append(data, size);
+  });
+
+  auto status = wait_process(child.pid);
   if (WIFEXITED(status)) {
     auto code = WEXITSTATUS(status);
     if (code)
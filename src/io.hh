@@ -0,0 +1,52 @@
+#include <functional>
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <eval.hh>
+
+#if HAVE_BOEHMGC
+#include <gc/gc_cpp.h>
+#define NEW new (UseGC)
+#else
+#define NEW new
+#endif
+
+enum class io_kind { unit, map, join, bind, then, sequence, traverse, foldm, dlopen, realise, parallel, async_dlopen, await, effect };
+
+class io_value : public nix::ExternalValueBase {
+  std::string showType() const override {
+    return "a nix-exec IO value";
+  };
+
+  std::string typeOf() const override {
+    return "nix-exec-io";
+  };
+
+  public:
+  /* Nodes are dispatched on this tag instead of through virtual calls */
+  const io_kind kind;
+
+  io_value(io_kind kind) : kind(kind) {};
+};
+
+/* Leaves defined outside nix-exec-lib.cc. They're dispatched through virtual
+ * calls, which is fine for effects that cost far more than the call does.
+ */
+class effect_value : public io_value {
+  public:
+  effect_value() : io_value(io_kind::effect) {};
+
+  /* Runs the effect, leaving its result in v */
+  virtual void perform(nix::EvalState & state, nix::Value & v) = 0;
+
+  /* Every value the node refers to, for the optimizer and --io-stats */
+  virtual void for_each_value(const std::function<void(nix::Value &)> & f) = 0;
+
+  virtual const nix::Pos & position() const = 0;
+};
+
+/* Realises ctx, skipping anything this process has already realised */
+void realise_context(nix::EvalState & state, const nix::PathSet & ctx);
@@ -0,0 +1,219 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cerrno>
+extern "C" {
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <shared.hh>
+#include <store-api.hh>
+#include <eval.hh>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+#include "nix-exec.hh"
+#include "trace.hh"
+
+/* Each scenario is a function of lib, the path to the benchmark plugin, and
+ * a size, returning the IO value to run.
+ */
+struct scenario {
+  const char * name;
+  nix::NixInt size;
+  const char * expr;
+  /* Fail the run if peak RSS exceeds this many KiB, 0 for no limit */
+  long max_rss;
+};
+
+static const scenario scenarios[] = {
+  { "map-left"
+  , 100000
+  , "lib: plugin: n: let go = i: if i == 0 then lib.unit 0 "
+      "else lib.map (x: x + 1) (go (i - 1)); in go n"
+  , 0
+  }
+, { "join-map"
+  , 100000
+  , "lib: plugin: n: let go = i: lib.join (lib.map (x: if x == 0 "
+      "then lib.unit 0 else go (x - 1)) (lib.unit i)); in go n"
+  , 0
+  }
+, { "join-tower"
+  , 100000
+  , "lib: plugin: n: let go = i: if i == 0 then lib.unit 0 "
+      "else lib.join (lib.unit (go (i - 1))); in go n"
+  , 0
+  }
+, { "unit-chain"
+  , 100000
+  , "lib: plugin: n: let go = i: if i == 0 then lib.unit 0 "
+      "else lib.bind (go (i - 1)) (x: lib.unit (x + 1)); in go n"
+  , 0
+  }
+, { "sequence-wide"
+  , 100000
+  , "lib: plugin: n: lib.sequence (builtins.genList lib.unit n)"
+  , 0
+  }
+, { "traverse-wide"
+  , 100000
+  , "lib: plugin: n: lib.traverse lib.unit (builtins.genList (i: i) n)"
+  , 0
+  }
+, { "dlopen"
+  , 100000
+  , "lib: plugin: n: lib.sequence (builtins.genList "
+      "(i: lib.dlopen plugin \"nop\" [ i ]) n)"
+  , 0
+  }
+  /* A tail-recursive loop must run in bounded memory */
+, { "loop"
+  , 1000000
+  , "lib: plugin: n: let go = i: if i == 0 then lib.unit 0 "
+      "else lib.bind (lib.unit i) (x: go (x - 1)); in go n"
+  , 256 * 1024
+  }
+};
+
+static long peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1)
+    throw nix::SysError("getting resource usage");
+  return usage.ru_maxrss;
+}
+
+static unsigned long nodes_run() {
+  auto res = 0ul;
+  for_each_io_count([&] (const char *, unsigned long count) {
+    res += count;
+  });
+  return res;
+}
+
+static size_t gc_bytes() {
+#if HAVE_BOEHMGC
+  return GC_get_total_bytes();
+#else
+  return 0;
+#endif
+}
+
+static bool run_scenario( nix::EvalState & state
+                        , nix::Value & lib
+                        , nix::Value & plugin
+                        , const scenario & s
+                        ) {
+  auto & fn = *state.allocValue();
+  state.eval(state.parseExprFromString(s.expr, "/"), fn);
+
+  auto & with_lib = *state.allocValue();
+  state.callFunction(fn, lib, with_lib, nix::noPos);
+  auto & with_plugin = *state.allocValue();
+  state.callFunction(with_lib, plugin, with_plugin, nix::noPos);
+  auto & size = *state.allocValue();
+  nix::mkInt(size, s.size);
+  auto & program = *state.allocValue();
+  state.callFunction(with_plugin, size, program, nix::noPos);
+
+  auto nodes_before = nodes_run();
+  auto bytes_before = gc_bytes();
+  auto start = std::chrono::steady_clock::now();
+
+  nix::Value v;
+  run_io(state, program, nix::noPos, v);
+
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  auto nodes = nodes_run() - nodes_before;
+  auto bytes = gc_bytes() - bytes_before;
+  auto rss = peak_rss();
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << std::left << std::setw(16) << s.name << std::right
+            << std::setw(10) << nodes << " nodes"
+            << std::fixed << std::setprecision(1)
+            << std::setw(10) << (double) ns / nodes << " ns/node"
+            << std::setw(10) << (double) bytes / nodes << " B/node"
+            << std::setw(10) << rss << " KiB peak RSS"
+            << std::endl;
+
+  if (s.max_rss && rss > s.max_rss) {
+    std::cerr << s.name << ": peak RSS " << rss << " KiB exceeds the limit of "
+              << s.max_rss << " KiB" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static void run() {
+  nix::initNix();
+  nix::initGC();
+
+  if (nixexec_argc != 2 && nixexec_argc != 3)
+    throw nix::UsageError("Usage: nix-exec-bench [--optimize-io] PLUGIN");
+  if (nixexec_argc == 3) {
+    if (nix::string(nixexec_argv[1]) != "--optimize-io")
+      throw nix::UsageError(nix::format("unknown option `%1%'") % nixexec_argv[1]);
+    optimize_io = true;
+  }
+
+  auto store = nix::openStore();
+  auto state = nix::EvalState{nix::Strings{}, store};
+
+  auto & lib = *state.allocValue();
+  setup_lib(state, lib);
+
+  auto & plugin = *state.allocValue();
+  nix::mkString(plugin, nixexec_argv[nixexec_argc - 1]);
+
+  /* The collector only counts bytes, so that stands in for allocations */
+  std::cout << "# B/node: bytes allocated by the collector per node run, "
+               "in place of an allocation count" << std::endl;
+
+  auto failed = false;
+  /* Each scenario runs in its own process so that peak RSS is its own */
+  for (auto & s : scenarios) {
+    trace_flush();
+    std::cout.flush();
+    auto child = fork();
+    switch (child) {
+      case -1:
+        throw nix::SysError("forking to run a benchmark");
+      case 0:
+      {
+        auto status = nix::handleExceptions(nixexec_argv[0], [&] {
+          if (!run_scenario(state, lib, plugin, s))
+            throw nix::Exit(1);
+        });
+        trace_flush();
+        _exit(status);
+      }
+    }
+
+    int status;
+    while (waitpid(child, &status, 0) == -1)
+      if (errno != EINTR)
+        throw nix::SysError("waiting for benchmark");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = true;
+  }
+
+  if (failed)
+    throw nix::Exit(1);
+}
+
+int main(int argc, char ** argv) {
+  nixexec_argc = argc;
+  nixexec_argv = argv;
+  return nix::handleExceptions(argv[0], run);
+}
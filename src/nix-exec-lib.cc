@@ -1,8 +1,22 @@
-#include <stack>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <ostream>
+#include <iostream>
+#include <typeinfo>
+#include <sstream>
 #include <cerrno>
 #include <cstring>
+#include <cstdio>
 extern "C" {
 #include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 }
 
 /* Work around nix's config.h */
@@ -14,18 +28,28 @@ extern "C" {
 #include <store-api.hh>
 #include <eval-inline.hh>
 #include <globals.hh>
+#include <value-to-json.hh>
+#include <json-to-value.hh>
 
 #if HAVE_BOEHMGC
-#include <gc/gc_cpp.h>
-#define NEW new (UseGC)
-#else
-#define NEW new
+#include <gc/gc.h>
+#include <gc/gc_allocator.h>
 #endif
 
 #include "nix-exec.hh"
+#include "io.hh"
+#include "trace.hh"
+#include "async.hh"
+#include "exec.hh"
+#include "process.hh"
 
 int nixexec_argc;
 char ** nixexec_argv;
+unsigned long nixexec_dlopen_cache_hits;
+unsigned long nixexec_dlopen_cache_misses;
+unsigned long nixexec_store_realisations;
+unsigned long nixexec_fetchgit_cache_hits;
+unsigned long nixexec_fetchgit_cache_misses;
 
 using nix::Value;
 using nix::Pos;
@@ -33,40 +57,85 @@ using nix::EvalState;
 using boost::format;
 using std::string;
 
-/* In order to achieve a tail-recursive implementation of run_io, we pass a
- * stack of nix function values around internally. The implementation below is
- * the moral equivalent of something like:
+/* run_io is a loop over an explicit continuation stack rather than a walk
+ * that recurses through the IO graph, so programs of any depth run in constant
+ * native stack. The implementation below is the moral equivalent of something
+ * like:
  *
  * call x [] = x
  * call x (Func f : fs) = call (f x) fs
  * call x (Run : fs) = run x fs
  *
+ * call x (Bind f : fs) = run (f x) fs
+ * call x (Then mb : fs) = run mb fs
+ *
  * run (Unit a) fs = call a fs
  * run (Map f ma) fs = run ma (Func f : fs)
  * run (Join mma) fs = run mma (Run : fs)
- * run (Dlopen path sym args) fs = run (Unit (runNativeCode path sym args)) fs
+ * run (Bind ma f) fs = run ma (Bind f : fs)
+ * run (Then ma mb) fs = run ma (Then mb : fs)
+ * run (Dlopen path sym args) fs = call (runNativeCode path sym args) fs
+ * run (Realise paths) fs = call (realiseAll paths) fs
+ * run (Parallel n ms) fs = call (forkAll n ms) fs
+ * run (AsyncDlopen path sym args) fs = call (startJob path sym args) fs
+ * run (Await job) fs = call (waitFor job) fs
+ * run (Effect e) fs = call (perform e) fs
+ *
+ * with sequence, traverse and foldM stepping through their list from a single
+ * frame each.
  */
 
-struct fn_stack_elem {
+enum class frame_kind { apply, run, bind, then, sequence, traverse, fold };
+
+/* node is the IO value that pushed the frame, kept to describe errors. The
+ * list-walking frames record the results so far in acc and their position in
+ * index.
+ */
+struct frame {
+  frame_kind kind;
+  const Pos * pos;
+  io_value * node;
   Value * fun;
-  const Pos & pos;
-  fn_stack_elem(Value * fun, const Pos & pos) : fun(fun), pos(pos) {};
+  Value * acc;
+  size_t index;
 };
 
-typedef std::stack<fn_stack_elem> fn_stack;
+/* The stack lives outside the native stack, but still has to be scanned since
+ * it may hold the only reference to intermediate results.
+ */
+#if HAVE_BOEHMGC
+typedef std::vector<frame, traceable_allocator<frame>> frame_stack;
+#else
+typedef std::vector<frame> frame_stack;
+#endif
 
-class io_value : public nix::ExternalValueBase {
-  string showType() const override {
-    return "a nix-exec IO value";
-  };
+static constexpr size_t initial_frames = 64;
 
-  string typeOf() const override {
-    return "nix-exec-io";
-  };
+/* The collector scans the stack's whole allocation, so popped slots are
+ * cleared to keep already-run parts of the program from staying reachable
+ * through its spare capacity. Without this, long-running loops grow forever.
+ */
+static void pop_frame(frame_stack & fns) {
+  fns.back() = frame{};
+  fns.pop_back();
+}
 
-  public:
-  virtual void run(EvalState & state, fn_stack & fns, Value & v) = 0;
-};
+/* dynamic_cast is comparatively slow and every node the interpreter runs has
+ * to be checked, so remember which concrete external types are IO values.
+ */
+static io_value * as_io_value(nix::ExternalValueBase & ext) {
+  static std::vector<const std::type_info *> io_types;
+
+  auto & type = typeid(ext);
+  for (auto known : io_types)
+    if (*known == type)
+      return static_cast<io_value *>(&ext);
+
+  auto res = dynamic_cast<io_value *>(&ext);
+  if (res)
+    io_types.push_back(&type);
+  return res;
+}
 
 static io_value & force_io_value( EvalState & state
                                 , Value & v
@@ -75,252 +144,1683 @@ static io_value & force_io_value( EvalState & state
   state.forceValue(v);
   io_value * val;
   auto is_io =  v.type == nix::tExternal
-             && (val = dynamic_cast<io_value *>(v.external));
+             && (val = as_io_value(*v.external));
   if (!is_io)
     nix::throwTypeError("value is %1% while a nix-exec IO value was expected, at %2%", v, pos);
   return *val;
 }
 
-static void apply_fns( EvalState & state
-                     , fn_stack & fns
-                     , Value * arg
-                     , Value & v
-                     ) {
-  assert(!fns.empty());
-  while (true) {
-    auto elem = fns.top();
-    fns.pop();
-    if (elem.fun) {
-      if (fns.empty())
-        return state.callFunction(*elem.fun, *arg, v, elem.pos);
-      auto & res = *state.allocValue();
-      state.callFunction(*elem.fun, *arg, res, elem.pos);
-      arg = &res;
-    } else {
-      return force_io_value(state, *arg, elem.pos).run(state, fns, v);
+class unit_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & a;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.unit (" << a << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&a) == seen.end()) {
+      seen.insert(&a);
+      /* Overestimates, since valueSize doesn't take the seen set. Oh well */
+      res += nix::valueSize(a);
+    }
+    return res;
+  };
+
+  /* Should we have operator==? There's no general way to write it such that
+   * (unit x) == (map id x), so for now no
+   */
+
+  public:
+  unit_value(Value & a) : io_value(io_kind::unit), a(a) {};
+};
+
+class map_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  /* If fused, a list of functions applied first to last */
+  Value & f;
+  const Pos & pos;
+  Value & ma_val;
+  bool fused;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.map (" << f << ") (" << ma_val <<")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&f) == seen.end()) {
+      seen.insert(&f);
+      res += nix::valueSize(f);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    if (seen.find(&ma_val) == seen.end()) {
+      seen.insert(&ma_val);
+      res += nix::valueSize(ma_val);
+    }
+    return res;
+  };
+
+  public:
+  map_value(Value & f, Value & ma_val, const Pos & pos, bool fused = false) :
+    io_value(io_kind::map), f(f), pos(pos), ma_val(ma_val), fused(fused) {};
+
+  void add_context(nix::Error & e, const frame & fr) const {
+    auto & f = *fr.fun;
+    if (f.type == nix::tLambda) {
+      e.addPrefix( format("while mapping %1% over %2%, at %3%:\n")
+                 % f.lambda.fun->showNamePos()
+                 % ma_val
+                 % pos
+                 );
+    } else {
+      auto op = &f;
+      while (op->type == nix::tPrimOpApp)
+        op = op->primOpApp.left;
+      e.addPrefix( format("while mapping primop %1% over %2%, at %3%:\n")
+                 % op->primOp->name
+                 % ma_val
+                 % pos
+                 );
+    }
+  };
+};
+
+class join_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  const Pos & pos;
+  Value & mma_val;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.join (" << mma_val << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&mma_val) == seen.end()) {
+      seen.insert(&mma_val);
+      res += nix::valueSize(mma_val);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  join_value(Value & mma_val, const Pos & pos) :
+    io_value(io_kind::join), pos(pos), mma_val(mma_val) {};
+
+  void add_context(nix::Error & e) const {
+    e.addPrefix( format("while joining %1%, at %2%:\n")
+               % mma_val
+               % pos
+               );
+  };
+};
+
+class bind_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & ma_val;
+  Value & f;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.bind (" << ma_val << ") (" << f << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&ma_val) == seen.end()) {
+      seen.insert(&ma_val);
+      res += nix::valueSize(ma_val);
+    }
+    if (seen.find(&f) == seen.end()) {
+      seen.insert(&f);
+      res += nix::valueSize(f);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  bind_value(Value & ma_val, Value & f, const Pos & pos) :
+    io_value(io_kind::bind), ma_val(ma_val), f(f), pos(pos) {};
+
+  void add_context(nix::Error & e, const frame &) const {
+    e.addPrefix( format("while binding %1% to %2%, at %3%:\n")
+               % ma_val
+               % f
+               % pos
+               );
+  };
+};
+
+class then_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & ma_val;
+  Value & mb_val;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.then' (" << ma_val << ") (" << mb_val << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&ma_val) == seen.end()) {
+      seen.insert(&ma_val);
+      res += nix::valueSize(ma_val);
+    }
+    if (seen.find(&mb_val) == seen.end()) {
+      seen.insert(&mb_val);
+      res += nix::valueSize(mb_val);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  then_value(Value & ma_val, Value & mb_val, const Pos & pos) :
+    io_value(io_kind::then), ma_val(ma_val), mb_val(mb_val), pos(pos) {};
+
+  void add_context(nix::Error & e, const frame &) const {
+    e.addPrefix( format("while running %1% before %2%, at %3%:\n")
+               % ma_val
+               % mb_val
+               % pos
+               );
+  };
+};
+
+/* sequence, traverse and foldM walk their list with a single frame that is
+ * updated in place, rather than building a map/join tree up front.
+ */
+class sequence_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & list;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.sequence (" << list << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&list) == seen.end()) {
+      seen.insert(&list);
+      res += nix::valueSize(list);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  sequence_value(Value & list, const Pos & pos) :
+    io_value(io_kind::sequence), list(list), pos(pos) {};
+
+  void add_context(nix::Error & e, const frame & f) const {
+    e.addPrefix( format("while running element %1% of the sequence %2%, at %3%:\n")
+               % f.index
+               % list
+               % pos
+               );
+  };
+};
+
+class traverse_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & f;
+  Value & list;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.traverse (" << f << ") (" << list << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&f) == seen.end()) {
+      seen.insert(&f);
+      res += nix::valueSize(f);
+    }
+    if (seen.find(&list) == seen.end()) {
+      seen.insert(&list);
+      res += nix::valueSize(list);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  traverse_value(Value & f, Value & list, const Pos & pos) :
+    io_value(io_kind::traverse), f(f), list(list), pos(pos) {};
+
+  void add_context(nix::Error & e, const frame & fr) const {
+    e.addPrefix( format("while traversing element %1% of %2% with %3%, at %4%:\n")
+               % fr.index
+               % list
+               % f
+               % pos
+               );
+  };
+};
+
+class foldm_value : public io_value {
+  friend void run_io(EvalState &, Value &, const Pos &, Value &);
+  friend struct io_graph;
+
+  Value & f;
+  Value & z;
+  Value & list;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.foldM (" << f << ") (" << z << ") (" << list
+        << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    size_t res = sizeof *this;
+    if (seen.find(&f) == seen.end()) {
+      seen.insert(&f);
+      res += nix::valueSize(f);
+    }
+    if (seen.find(&z) == seen.end()) {
+      seen.insert(&z);
+      res += nix::valueSize(z);
+    }
+    if (seen.find(&list) == seen.end()) {
+      seen.insert(&list);
+      res += nix::valueSize(list);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  foldm_value(Value & f, Value & z, Value & list, const Pos & pos) :
+    io_value(io_kind::foldm), f(f), z(z), list(list), pos(pos) {};
+
+  void add_context(nix::Error & e, const frame & fr) const {
+    e.addPrefix( format("while folding %1% over element %2% of %3%, at %4%:\n")
+               % f
+               % fr.index
+               % list
+               % pos
+               );
+  };
+};
+
+/* Context elements this process has already realised. Valid paths stay valid
+ * for the lifetime of the process, so realising them again can be skipped.
+ */
+static std::set<string> realised;
+
+void realise_context(EvalState & state, const nix::PathSet & ctx) {
+  auto needed = nix::PathSet{};
+  for (auto & c : ctx)
+    if (realised.find(c) == realised.end())
+      needed.insert(c);
+  if (needed.empty())
+    return;
+
+  ++nixexec_store_realisations;
+  state.realiseContext(needed);
+  realised.insert(needed.begin(), needed.end());
+}
+
+/* Loaded objects are never closed, so a resolved symbol stays valid for the
+ * lifetime of the process. Entries are only added once the filename's context
+ * has been realised, so a hit can skip realisation as well as the lookup.
+ */
+typedef std::map<std::pair<string, string>, void *> dlopen_cache;
+
+static dlopen_cache cached_syms;
+
+static void * load_symbol( EvalState & state
+                         , Value & filename_val
+                         , Value & symbol_val
+                         , const Pos & pos
+                         , trace_span & span
+                         ) {
+  auto ctx = nix::PathSet{};
+  auto filename = state.coerceToString( pos
+                                      , filename_val
+                                      , ctx
+                                      , false
+                                      , false
+                                      );
+  auto symbol = state.forceStringNoCtx(symbol_val, pos);
+
+  span.begin("dlopen", symbol);
+  span.arg("filename", filename);
+  span.arg("pos", pos);
+
+  auto key = std::make_pair(filename, symbol);
+  auto cached = cached_syms.find(key);
+  if (cached != cached_syms.end()) {
+    ++nixexec_dlopen_cache_hits;
+    return cached->second;
+  }
+  ++nixexec_dlopen_cache_misses;
+
+  try {
+    trace_span realise;
+    realise.begin("store", "realise");
+    realise.arg("filename", filename);
+    realise_context(state, ctx);
+  } catch (nix::InvalidPathError & e) {
+    throw nix::EvalError(format("cannot dlopen `%1%', since path `%2%' is not valid, at %3%")
+      % filename % e.path % pos);
+  }
+
+  auto handle = ::dlopen(filename.c_str(), RTLD_LAZY | RTLD_LOCAL);
+  if (!handle)
+    throw nix::EvalError(format("could not open `%1%': %2%") % filename % ::dlerror());
+
+  ::dlerror();
+  auto fn = ::dlsym(handle, symbol.c_str());
+  auto err = ::dlerror();
+  if (err)
+    throw nix::EvalError(format("could not load symbol `%1%' from `%2%': %3%") % symbol % filename % err);
+
+  cached_syms.emplace(std::move(key), fn);
+  return fn;
+}
+
+class dlopen_value : public io_value {
+  friend struct io_graph;
+
+  Value & filename_val;
+  Value & symbol_val;
+  Value & args;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.dlopen (" << filename_val << ") (" << symbol_val
+        << ") (" << args << ")";
+  };
+
+  nix::PrimOpFun load(EvalState & state, trace_span & span) {
+    return (nix::PrimOpFun) load_symbol(state, filename_val, symbol_val, pos, span);
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&filename_val) == seen.end()) {
+      seen.insert(&filename_val);
+      res += nix::valueSize(filename_val);
+    }
+    if (seen.find(&symbol_val) == seen.end()) {
+      seen.insert(&symbol_val);
+      res += nix::valueSize(symbol_val);
+    }
+    if (seen.find(&args) == seen.end()) {
+      seen.insert(&args);
+      res += nix::valueSize(args);
+    }
+    if (seen.find(&pos) == seen.end()) {
+      seen.insert(&pos);
+      res += sizeof pos;
+    }
+    return res;
+  };
+
+  public:
+  dlopen_value( Value & filename_val
+              , Value & symbol_val
+              , Value & args
+              , const Pos & pos
+              ) :
+    io_value(io_kind::dlopen),
+    filename_val(filename_val), symbol_val(symbol_val), args(args), pos(pos) {};
+
+  void call(EvalState & state, Value & v) {
+    trace_span span;
+    auto fn = load(state, span);
+    state.forceList(args, pos);
+    fn(state, pos, args.listElems(), v);
+  };
+};
+
+/* A job started by async-dlopen, to be waited for with await */
+class job_value : public nix::ExternalValueBase {
+  std::ostream & print(std::ostream & str) const override {
+    return str << "<nix-exec job started at " << pos << ">";
+  };
+
+  string showType() const override {
+    return "a nix-exec job";
+  };
+
+  string typeOf() const override {
+    return "nix-exec-job";
+  };
+
+  public:
+  async_job & job;
+  const Pos & pos;
+  /* Parsed on the first await, after which the job's copy is freed */
+  Value * result;
+
+  job_value(async_job & job, const Pos & pos) :
+    job(job), pos(pos), result(nullptr) {};
+};
+
+#if HAVE_BOEHMGC
+static void release_job(void * obj, void *) {
+  static_cast<job_value *>(obj)->job.release();
+}
+#endif
+
+/* Starts an asynchronous plugin entry point on the worker threads and yields
+ * its job straight away. Its arguments are converted to plain data here, on
+ * the evaluator's thread.
+ */
+class async_dlopen_value : public io_value {
+  friend struct io_graph;
+
+  Value & filename_val;
+  Value & symbol_val;
+  Value & args;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.async-dlopen (" << filename_val << ") ("
+        << symbol_val << ") (" << args << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&filename_val) == seen.end()) {
+      seen.insert(&filename_val);
+      res += nix::valueSize(filename_val);
+    }
+    if (seen.find(&symbol_val) == seen.end()) {
+      seen.insert(&symbol_val);
+      res += nix::valueSize(symbol_val);
+    }
+    if (seen.find(&args) == seen.end()) {
+      seen.insert(&args);
+      res += nix::valueSize(args);
+    }
+    return res;
+  };
+
+  public:
+  async_dlopen_value( Value & filename_val
+                    , Value & symbol_val
+                    , Value & args
+                    , const Pos & pos
+                    ) :
+    io_value(io_kind::async_dlopen),
+    filename_val(filename_val), symbol_val(symbol_val), args(args), pos(pos) {};
+
+  void call(EvalState & state, Value & v) {
+    trace_span span;
+    auto fn = (nixexec_async_fun) load_symbol( state
+                                             , filename_val
+                                             , symbol_val
+                                             , pos
+                                             , span
+                                             );
+
+    state.forceList(args, pos);
+    std::ostringstream str;
+    auto ctx = nix::PathSet{};
+    nix::printValueAsJSON(state, true, args, str, ctx);
+    try {
+      realise_context(state, ctx);
+    } catch (nix::InvalidPathError & e) {
+      throw nix::EvalError(format("cannot pass path `%1%' to a job, since it is not valid, at %2%")
+        % e.path % pos);
+    }
+
+    auto job = new async_job(fn, str.str());
+    start_job(*job);
+    auto res = NEW job_value(*job, pos);
+#if HAVE_BOEHMGC
+    /* The job goes when the last value referring to it does */
+    GC_register_finalizer_ignore_self(res, release_job, nullptr, nullptr, nullptr);
+#endif
+    v.type = nix::tExternal;
+    v.external = res;
+  };
+};
+
+class await_value : public io_value {
+  friend struct io_graph;
+
+  Value & job_val;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.await (" << job_val << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&job_val) == seen.end()) {
+      seen.insert(&job_val);
+      res += nix::valueSize(job_val);
+    }
+    return res;
+  };
+
+  public:
+  await_value(Value & job_val, const Pos & pos) :
+    io_value(io_kind::await), job_val(job_val), pos(pos) {};
+
+  void call(EvalState & state, Value & v) {
+    state.forceValue(job_val);
+    job_value * job;
+    auto is_job =  job_val.type == nix::tExternal
+                && (job = dynamic_cast<job_value *>(job_val.external));
+    if (!is_job)
+      nix::throwTypeError("value is %1% while a nix-exec job was expected, at %2%", job_val, pos);
+
+    if (!job->result) {
+      trace_span span;
+      span.begin("async", "await");
+      span.arg("pos", pos);
+      string output;
+      if (!job->job.wait(output))
+        throw nix::EvalError(format("the job started at %1% failed: %2%, at %3%")
+          % job->pos % output % pos);
+      span.end();
+
+      auto result = state.allocValue();
+      nix::parseJSON(state, output, *result);
+      job->result = result;
+      job->job.forget_output();
+    }
+    v = *job->result;
+  };
+};
+
+/* Realises the contexts of a whole list of paths with a single store call, so
+ * the store can build and substitute them in parallel.
+ */
+class realise_value : public io_value {
+  friend struct io_graph;
+
+  Value & list;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.builtins.realise (" << list << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&list) == seen.end()) {
+      seen.insert(&list);
+      res += nix::valueSize(list);
+    }
+    return res;
+  };
+
+  public:
+  realise_value(Value & list, const Pos & pos) :
+    io_value(io_kind::realise), list(list), pos(pos) {};
+
+  void call(EvalState & state, Value & v) {
+    state.forceList(list, pos);
+    auto size = list.listSize();
+
+    auto ctx = nix::PathSet{};
+    auto paths = std::vector<std::pair<string, nix::PathSet>>{};
+    paths.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+      auto elem_ctx = nix::PathSet{};
+      auto path = state.coerceToString( pos
+                                      , *list.listElems()[i]
+                                      , elem_ctx
+                                      , false
+                                      , false
+                                      );
+      ctx.insert(elem_ctx.begin(), elem_ctx.end());
+      paths.emplace_back(std::move(path), std::move(elem_ctx));
+    }
+
+    try {
+      trace_span span;
+      span.begin("store", "realise");
+      span.arg("pos", pos);
+      realise_context(state, ctx);
+    } catch (nix::InvalidPathError & e) {
+      throw nix::EvalError(format("cannot realise path `%1%', since it is not valid, at %2%")
+        % e.path % pos);
+    }
+
+    state.mkList(v, size);
+    for (size_t i = 0; i < size; ++i) {
+      auto & elem = *(v.listElems()[i] = state.allocValue());
+      nix::mkString(elem, paths[i].first, paths[i].second);
+    }
+  };
+};
+
+/* Runs each IO value in a forked worker, so independent actions overlap
+ * without the evaluator having to be thread-safe. Workers start from a copy
+ * of the parent's heap, so everything already evaluated is shared, and send
+ * their result back as JSON.
+ */
+class parallel_value : public io_value {
+  friend struct io_graph;
+
+  Value & limit;
+  Value & list;
+  const Pos & pos;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.parallel (" << limit << ") (" << list << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&limit) == seen.end()) {
+      seen.insert(&limit);
+      res += nix::valueSize(limit);
+    }
+    if (seen.find(&list) == seen.end()) {
+      seen.insert(&list);
+      res += nix::valueSize(list);
+    }
+    return res;
+  };
+
+  public:
+  parallel_value(Value & limit, Value & list, const Pos & pos) :
+    io_value(io_kind::parallel), limit(limit), list(list), pos(pos) {};
+
+  void call(EvalState & state, Value & v);
+};
+
+static string describe_fun(Value & fun) {
+  if (fun.type == nix::tLambda)
+    return fun.lambda.fun->showNamePos();
+  auto op = &fun;
+  while (op->type == nix::tPrimOpApp)
+    op = op->primOpApp.left;
+  if (op->type == nix::tPrimOp)
+    return "primop " + static_cast<const string &>(op->primOp->name);
+  return nix::showType(fun);
+}
+
+/* With show-trace, frames are described in full, including the IO values
+ * involved. Otherwise they're summarized, since printing values can be slow
+ * and make for enormous messages.
+ */
+static void add_context(nix::Error & e, const frame & f) {
+  if (nix::settings.showTrace) {
+    switch (f.node->kind) {
+      case io_kind::map:
+        return static_cast<const map_value *>(f.node)->add_context(e, f);
+      case io_kind::join:
+        return static_cast<const join_value *>(f.node)->add_context(e);
+      case io_kind::bind:
+        return static_cast<const bind_value *>(f.node)->add_context(e, f);
+      case io_kind::then:
+        return static_cast<const then_value *>(f.node)->add_context(e, f);
+      case io_kind::sequence:
+        return static_cast<const sequence_value *>(f.node)->add_context(e, f);
+      case io_kind::traverse:
+        return static_cast<const traverse_value *>(f.node)->add_context(e, f);
+      case io_kind::foldm:
+        return static_cast<const foldm_value *>(f.node)->add_context(e, f);
+      default:
+        return;
     }
   }
+
+  switch (f.kind) {
+    case frame_kind::apply:
+      e.addPrefix(format("while mapping %1%, at %2%:\n") % describe_fun(*f.fun) % *f.pos);
+      return;
+    case frame_kind::run:
+      e.addPrefix(format("while joining, at %1%:\n") % *f.pos);
+      return;
+    case frame_kind::bind:
+      e.addPrefix(format("while binding to %1%, at %2%:\n") % describe_fun(*f.fun) % *f.pos);
+      return;
+    case frame_kind::then:
+      e.addPrefix(format("while running the first of two IO values, at %1%:\n") % *f.pos);
+      return;
+    case frame_kind::sequence:
+      e.addPrefix(format("while running element %1% of a sequence, at %2%:\n") % f.index % *f.pos);
+      return;
+    case frame_kind::traverse:
+      e.addPrefix( format("while traversing element %1% with %2%, at %3%:\n")
+                 % f.index
+                 % describe_fun(*f.fun)
+                 % *f.pos
+                 );
+      return;
+    case frame_kind::fold:
+      e.addPrefix( format("while folding %1% over element %2%, at %3%:\n")
+                 % describe_fun(*f.fun)
+                 % f.index
+                 % *f.pos
+                 );
+      return;
+  }
 }
 
-class unit_value : public io_value {
-  Value & a;
+/* Without show-trace, only this many frames from each end of the stack are
+ * described
+ */
+static constexpr size_t context_frames = 16;
+
+static Value & apply( EvalState & state
+                    , Value & fun
+                    , Value & arg
+                    , const Pos & pos
+                    ) {
+  trace_span span;
+  if (tracing) {
+    span.begin("apply", describe_fun(fun));
+    span.arg("pos", pos);
+  }
+  auto & res = *state.allocValue();
+  state.callFunction(fun, arg, res, pos);
+  return res;
+}
 
-  std::ostream & print(std::ostream & str) const override {
-    return str << "nix-exec-lib.unit (" << a << ")";
+bool optimize_io = false;
+
+/* Rewrites IO graphs using the monad laws before they're run:
+ *
+ * map f (map g m) = map (f . g) m
+ * map f (unit a) = unit (f a)
+ * join (unit m) = m
+ * join (map f m) = bind m f
+ *
+ * The IO values run_io forces first when running a node (the ones that run
+ * before anything else does) are forced; other children are only looked at
+ * if they're already forced, so optimizing never evaluates anything the
+ * program itself wouldn't have. Fused maps keep a list of their functions,
+ * which run_io applies one at a time, rather than nesting compositions that
+ * would be evaluated recursively. Rewritten nodes are equivalent to the
+ * originals, so they replace them in place.
+ */
+struct io_graph {
+  static io_value * forced_io(Value & v) {
+    return v.type == nix::tExternal ? as_io_value(*v.external) : nullptr;
   };
 
-  void run(EvalState & state, fn_stack & fns, Value & v) override {
-    if (fns.empty()) {
-      state.forceValue(a);
-      v = a;
-    } else {
-      return apply_fns(state, fns, &a, v);
+  /* Forces a child that run_io would force first anyway. If that fails, it's
+   * left for run_io to fail on, with the context of the running program.
+   */
+  static io_value * force_io(EvalState & state, Value & v) {
+    try {
+      state.forceValue(v);
+    } catch (nix::Error &) {
+      return nullptr;
     }
+    return forced_io(v);
   };
 
-  size_t valueSize(std::set<const void *> & seen) const override {
-    size_t res = sizeof *this;
-    if (seen.find(&a) == seen.end()) {
-      seen.insert(&a);
-      /* Overestimates, since valueSize doesn't take the seen set. Oh well */
-      res += nix::valueSize(a);
+  /* The functions of a map, in the order they're applied */
+  static void map_functions(map_value & m, std::vector<Value *> & fs) {
+    if (!m.fused) {
+      fs.push_back(&m.f);
+      return;
     }
-    return res;
+    for (size_t i = 0; i < m.f.listSize(); ++i)
+      fs.push_back(m.f.listElems()[i]);
   };
 
-  /* Should we have operator==? There's no general way to write it such that
-   * (unit x) == (map id x), so for now no
-   */
-
-  public:
-  unit_value(Value & a) : a(a) {};
-};
-
-class map_value : public io_value {
-  Value & f;
-  const Pos & pos;
-  Value & ma_val;
-
-  std::ostream & print(std::ostream & str) const override {
-    return str << "nix-exec-lib.map (" << f << ") (" << ma_val <<")";
+  static bool rewrite(EvalState & state, Value & v) {
+    auto node = static_cast<io_value *>(v.external);
+    switch (node->kind) {
+      case io_kind::map: {
+        auto & m = *static_cast<map_value *>(node);
+        auto inner = force_io(state, m.ma_val);
+        if (!inner)
+          return false;
+        if (inner->kind == io_kind::map) {
+          /* The whole chain at once, since fusing a pair at a time would
+           * copy the functions gathered so far at every step
+           */
+          auto chain = std::vector<map_value *>{&m};
+          auto seen = std::unordered_set<io_value *>{&m};
+          for (auto next = inner; next && next->kind == io_kind::map;
+               next = force_io(state, chain.back()->ma_val)) {
+            /* A map of itself never runs anything, so leave it be */
+            if (!seen.insert(next).second)
+              return false;
+            chain.push_back(static_cast<map_value *>(next));
+          }
+          auto fs = std::vector<Value *>{};
+          for (auto i = chain.rbegin(); i != chain.rend(); ++i)
+            map_functions(**i, fs);
+          auto & list = *state.allocValue();
+          state.mkList(list, fs.size());
+          std::copy(fs.begin(), fs.end(), list.listElems());
+          v.external = NEW map_value(list, chain.back()->ma_val, m.pos, true);
+          return true;
+        } else if (inner->kind == io_kind::unit && !m.fused) {
+          auto & fa = *state.allocValue();
+          nix::mkApp(fa, m.f, static_cast<unit_value *>(inner)->a);
+          v.external = NEW unit_value(fa);
+          return true;
+        }
+        return false;
+      }
+      case io_kind::join: {
+        auto & j = *static_cast<join_value *>(node);
+        auto inner = force_io(state, j.mma_val);
+        if (!inner)
+          return false;
+        if (inner->kind == io_kind::unit) {
+          auto & a = static_cast<unit_value *>(inner)->a;
+          if (&a == &v || !force_io(state, a))
+            return false;
+          v = a;
+          return true;
+        } else if (inner->kind == io_kind::map &&
+                   !static_cast<map_value *>(inner)->fused) {
+          auto & i = *static_cast<map_value *>(inner);
+          v.external = NEW bind_value(i.ma_val, i.f, j.pos);
+          return true;
+        }
+        return false;
+      }
+      default:
+        return false;
+    }
   };
 
-  void run(EvalState & state, fn_stack & fns, Value & v) override {
-    state.forceFunction(f, pos);
-    fns.emplace(&f, pos);
-    auto & ma = force_io_value(state, ma_val, pos);
-    if (nix::settings.showTrace) {
-      try {
-        return ma.run(state, fns, v);
-      } catch (nix::Error & e) {
-        if (f.type == nix::tLambda) {
-          e.addPrefix( format("while mapping %1% over %2%, at %3%:\n")
-                     % f.lambda.fun->showNamePos()
-                     % ma
-                     % pos
-                     );
-        } else {
-          auto op = &f;
-          while (op->type == nix::tPrimOpApp)
-            op = op->primOpApp.left;
-          e.addPrefix( format("while mapping primop %1% over %2%, at %3%:\n")
-                     % op->primOp->name
-                     % ma
-                     % pos
-                     );
-        }
-        throw;
+  /* f is also told whether run_io forces the child first when running node */
+  template <typename F> static void for_each_child(io_value & node, F f) {
+    switch (node.kind) {
+      case io_kind::unit:
+        return f(static_cast<unit_value &>(node).a, false);
+      case io_kind::map:
+        return f(static_cast<map_value &>(node).ma_val, true);
+      case io_kind::join:
+        return f(static_cast<join_value &>(node).mma_val, true);
+      case io_kind::bind:
+        return f(static_cast<bind_value &>(node).ma_val, true);
+      case io_kind::then:
+        f(static_cast<then_value &>(node).ma_val, true);
+        return f(static_cast<then_value &>(node).mb_val, false);
+      case io_kind::sequence: {
+        auto & list = static_cast<sequence_value &>(node).list;
+        if (list.isList())
+          for (size_t i = 0; i < list.listSize(); ++i)
+            f(*list.listElems()[i], false);
+        return;
       }
-    } else
-      return ma.run(state, fns, v);
+      default:
+        return;
+    }
   };
 
-  size_t valueSize(std::set<const void *> & seen) const override {
-    size_t res = sizeof *this;
-    if (seen.find(&f) == seen.end()) {
-      seen.insert(&f);
-      res += nix::valueSize(f);
+  /* Every value a node refers to, whether or not it's an IO value */
+  template <typename F> static void for_each_value(io_value & node, F f) {
+    switch (node.kind) {
+      case io_kind::unit:
+        return f(static_cast<unit_value &>(node).a);
+      case io_kind::map:
+        f(static_cast<map_value &>(node).f);
+        return f(static_cast<map_value &>(node).ma_val);
+      case io_kind::join:
+        return f(static_cast<join_value &>(node).mma_val);
+      case io_kind::bind:
+        f(static_cast<bind_value &>(node).ma_val);
+        return f(static_cast<bind_value &>(node).f);
+      case io_kind::then:
+        f(static_cast<then_value &>(node).ma_val);
+        return f(static_cast<then_value &>(node).mb_val);
+      case io_kind::sequence:
+        return f(static_cast<sequence_value &>(node).list);
+      case io_kind::traverse:
+        f(static_cast<traverse_value &>(node).f);
+        return f(static_cast<traverse_value &>(node).list);
+      case io_kind::foldm:
+        f(static_cast<foldm_value &>(node).f);
+        f(static_cast<foldm_value &>(node).z);
+        return f(static_cast<foldm_value &>(node).list);
+      case io_kind::dlopen:
+        f(static_cast<dlopen_value &>(node).filename_val);
+        f(static_cast<dlopen_value &>(node).symbol_val);
+        return f(static_cast<dlopen_value &>(node).args);
+      case io_kind::realise:
+        return f(static_cast<realise_value &>(node).list);
+      case io_kind::parallel:
+        f(static_cast<parallel_value &>(node).limit);
+        return f(static_cast<parallel_value &>(node).list);
+      case io_kind::async_dlopen:
+        f(static_cast<async_dlopen_value &>(node).filename_val);
+        f(static_cast<async_dlopen_value &>(node).symbol_val);
+        return f(static_cast<async_dlopen_value &>(node).args);
+      case io_kind::await:
+        return f(static_cast<await_value &>(node).job_val);
+      case io_kind::effect:
+        return static_cast<effect_value &>(node).for_each_value(f);
     }
-    if (seen.find(&pos) == seen.end()) {
-      seen.insert(&pos);
-      res += sizeof pos;
+  };
+
+  static const Pos * pos_of(io_value & node) {
+    switch (node.kind) {
+      case io_kind::unit:
+        return nullptr;
+      case io_kind::map:
+        return &static_cast<map_value &>(node).pos;
+      case io_kind::join:
+        return &static_cast<join_value &>(node).pos;
+      case io_kind::bind:
+        return &static_cast<bind_value &>(node).pos;
+      case io_kind::then:
+        return &static_cast<then_value &>(node).pos;
+      case io_kind::sequence:
+        return &static_cast<sequence_value &>(node).pos;
+      case io_kind::traverse:
+        return &static_cast<traverse_value &>(node).pos;
+      case io_kind::foldm:
+        return &static_cast<foldm_value &>(node).pos;
+      case io_kind::dlopen:
+        return &static_cast<dlopen_value &>(node).pos;
+      case io_kind::realise:
+        return &static_cast<realise_value &>(node).pos;
+      case io_kind::parallel:
+        return &static_cast<parallel_value &>(node).pos;
+      case io_kind::async_dlopen:
+        return &static_cast<async_dlopen_value &>(node).pos;
+      case io_kind::await:
+        return &static_cast<await_value &>(node).pos;
+      case io_kind::effect:
+        return &static_cast<effect_value &>(node).position();
     }
-    if (seen.find(&ma_val) == seen.end()) {
-      seen.insert(&ma_val);
-      res += nix::valueSize(ma_val);
+    return nullptr;
+  };
+
+  static void optimize(EvalState & state, Value & root) {
+    std::vector<Value *> todo{&root};
+    std::unordered_set<Value *> seen{&root};
+    while (!todo.empty()) {
+      auto & v = *todo.back();
+      todo.pop_back();
+      while (rewrite(state, v));
+      for_each_child(*static_cast<io_value *>(v.external), [&] (Value & child, bool spine) {
+        auto io = spine ? force_io(state, child) : forced_io(child);
+        if (io && seen.insert(&child).second)
+          todo.push_back(&child);
+      });
     }
-    return res;
   };
+};
 
-  public:
-  map_value(Value & f, Value & ma_val, const Pos & pos) :
-    f(f), pos(pos), ma_val(ma_val) {};
+/* EvalState's store is a const member and nix has no way to give a state
+ * another one, but a forked child can't keep using its parent's: the daemon
+ * connection (or database handle) would carry both processes' requests at
+ * once. So the reference is rebound in place, which the language doesn't
+ * sanction for a const member. This is the one place that does it, out of
+ * line so no caller can have the old store cached across the call, and only
+ * right after forking, before the child has used the store.
+ */
+void reopen_store(EvalState & state) {
+  const_cast<nix::ref<nix::Store> &>(state.store) = nix::openStore();
+}
+
+struct worker {
+  pid_t pid;
+  nix::AutoCloseFD fd;
+  size_t index;
 };
 
-class join_value : public io_value {
-  const Pos & pos;
-  Value & mma_val;
+/* Never returns. The result (or the error) goes to fd as text, and the exit
+ * status says which it is.
+ */
+[[noreturn]] static void run_worker( EvalState & state
+                                   , Value & action
+                                   , const Pos & pos
+                                   , int fd
+                                   ) {
+  auto status = 0;
+  string out;
+  try {
+    /* The parent's store connection would be shared with it and every other
+     * worker, interleaving their requests
+     */
+    reopen_store(state);
+    Value res;
+    run_io(state, action, pos, res);
+    std::ostringstream str;
+    auto ctx = nix::PathSet{};
+    nix::printValueAsJSON(state, true, res, str, ctx);
+    out = str.str();
+  } catch (nix::BaseError & e) {
+    status = 1;
+    out = e.msg();
+  } catch (std::exception & e) {
+    status = 1;
+    out = e.what();
+  } catch (...) {
+    status = 1;
+    out = "unknown error";
+  }
 
-  std::ostream & print(std::ostream & str) const override {
-    return str << "nix-exec-lib.join (" << mma_val << ")";
-  };
+  try {
+    nix::writeFull(fd, out);
+  } catch (nix::SysError &) {
+    status = 1;
+  }
+  /* The parent flushed before forking, so what's buffered now is the
+   * worker's own; atexit handlers are the parent's
+   */
+  trace_flush();
+  std::cout.flush();
+  std::cerr.flush();
+  fflush(stdout);
+  fflush(stderr);
+  _exit(status);
+}
 
-  void run(EvalState & state, fn_stack & fns, Value & v) override {
-    auto & mma = force_io_value(state, mma_val, pos);
-    fns.emplace(nullptr, pos);
-    if (nix::settings.showTrace) {
-      try {
-        mma.run(state, fns, v);
-      } catch (nix::Error & e) {
-        e.addPrefix( format("while joining %1%, at %2%:\n")
-                   % mma
-                   % pos
-                   );
-        throw;
+void parallel_value::call(EvalState & state, Value & v) {
+  auto max = state.forceInt(limit, pos);
+  if (max < 1)
+    throw nix::EvalError(format("the parallelism limit must be positive, not %1%, at %2%")
+      % max % pos);
+  state.forceList(list, pos);
+  auto size = list.listSize();
+
+  /* Forced before forking, so the work is shared and errors can name where
+   * each action came from.
+   */
+  auto nodes = std::vector<io_value *>{};
+  nodes.reserve(size);
+  for (size_t i = 0; i < size; ++i)
+    nodes.push_back(&force_io_value(state, *list.listElems()[i], pos));
+
+  trace_span span;
+  span.begin("parallel", "parallel");
+  span.arg("pos", pos);
+
+  auto outputs = std::vector<string>(size);
+  auto statuses = std::vector<int>(size);
+  auto running = std::vector<worker>{};
+  size_t next = 0;
+
+  try {
+    while (next < size || !running.empty()) {
+      while (next < size && running.size() < size_t(max)) {
+        nix::Pipe pipe;
+        pipe.create();
+        /* Or the worker would write out our buffered output a second time */
+        trace_flush();
+        std::cout.flush();
+        std::cerr.flush();
+        fflush(stdout);
+        fflush(stderr);
+        auto pid = fork();
+        if (pid == -1)
+          throw nix::SysError("forking a parallel worker");
+        if (pid == 0) {
+          pipe.readSide.close();
+          run_worker(state, *list.listElems()[next], pos, pipe.writeSide.get());
+        }
+        pipe.writeSide.close();
+        running.push_back(worker{pid, std::move(pipe.readSide), next++});
       }
-    } else
-      return mma.run(state, fns, v);
-  };
 
-  size_t valueSize(std::set<const void *> & seen) const override {
-    size_t res = sizeof *this;
-    if (seen.find(&mma_val) == seen.end()) {
-      seen.insert(&mma_val);
-      res += nix::valueSize(mma_val);
+      auto fds = std::vector<pollfd>{};
+      for (auto & w : running)
+        fds.push_back(pollfd{w.fd.get(), POLLIN, 0});
+      if (poll(fds.data(), fds.size(), -1) == -1) {
+        if (errno != EINTR)
+          throw nix::SysError("waiting for parallel workers");
+        nix::checkInterrupt();
+        continue;
+      }
+
+      for (size_t i = fds.size(); i-- > 0;) {
+        if (!fds[i].revents)
+          continue;
+        auto & w = running[i];
+        char buf[4096];
+        auto count = read(w.fd.get(), buf, sizeof buf);
+        if (count == -1) {
+          if (errno == EINTR)
+            continue;
+          throw nix::SysError("reading from a parallel worker");
+        }
+        if (count > 0) {
+          outputs[w.index].append(buf, count);
+          continue;
+        }
+        if (waitpid(w.pid, &statuses[w.index], 0) == -1)
+          throw nix::SysError("waiting for a parallel worker");
+        running.erase(running.begin() + i);
+      }
     }
-    if (seen.find(&pos) == seen.end()) {
-      seen.insert(&pos);
-      res += sizeof pos;
+  } catch (...) {
+    for (auto & w : running) {
+      kill(w.pid, SIGTERM);
+      waitpid(w.pid, nullptr, 0);
     }
-    return res;
-  };
+    throw;
+  }
 
-  public:
-  join_value(Value & mma_val, const Pos & pos) : pos(pos), mma_val(mma_val) {};
-};
+  auto failures = 0;
+  auto messages = string{};
+  for (size_t i = 0; i < size; ++i) {
+    if (statuses[i] == 0)
+      continue;
+    ++failures;
+    auto action_pos = io_graph::pos_of(*nodes[i]);
+    messages += (format("action %1%, at %2%: %3%\n")
+      % i
+      % (action_pos ? *action_pos : pos)
+      % (outputs[i].empty() ? nix::statusToString(statuses[i]) : outputs[i])).str();
+  }
+  if (failures)
+    throw nix::EvalError(format("%1% of %2% parallel actions failed, at %3%:\n%4%")
+      % failures % size % pos % messages);
+
+  state.mkList(v, size);
+  for (size_t i = 0; i < size; ++i) {
+    auto & elem = *(v.listElems()[i] = state.allocValue());
+    nix::parseJSON(state, outputs[i], elem);
+  }
+}
 
-class dlopen_value : public io_value {
-  Value & filename_val;
-  Value & symbol_val;
-  Value & args;
-  const Pos & pos;
+static constexpr size_t io_kinds = static_cast<size_t>(io_kind::effect) + 1;
+
+static const char * kind_name(io_kind kind) {
+  switch (kind) {
+    case io_kind::unit:
+      return "unit";
+    case io_kind::map:
+      return "map";
+    case io_kind::join:
+      return "join";
+    case io_kind::bind:
+      return "bind";
+    case io_kind::then:
+      return "then'";
+    case io_kind::sequence:
+      return "sequence";
+    case io_kind::traverse:
+      return "traverse";
+    case io_kind::foldm:
+      return "foldM";
+    case io_kind::dlopen:
+      return "dlopen";
+    case io_kind::realise:
+      return "realise";
+    case io_kind::parallel:
+      return "parallel";
+    case io_kind::async_dlopen:
+      return "async-dlopen";
+    case io_kind::await:
+      return "await";
+    case io_kind::effect:
+      return "effect";
+  }
+  return "unknown";
+}
 
-  std::ostream & print(std::ostream & str) const override {
-    return str << "nix-exec-lib.dlopen (" << filename_val << ") (" << symbol_val
-        << ") (" << args << ")";
+static size_t node_size(io_kind kind) {
+  switch (kind) {
+    case io_kind::unit:
+      return sizeof(unit_value);
+    case io_kind::map:
+      return sizeof(map_value);
+    case io_kind::join:
+      return sizeof(join_value);
+    case io_kind::bind:
+      return sizeof(bind_value);
+    case io_kind::then:
+      return sizeof(then_value);
+    case io_kind::sequence:
+      return sizeof(sequence_value);
+    case io_kind::traverse:
+      return sizeof(traverse_value);
+    case io_kind::foldm:
+      return sizeof(foldm_value);
+    case io_kind::dlopen:
+      return sizeof(dlopen_value);
+    case io_kind::realise:
+      return sizeof(realise_value);
+    case io_kind::parallel:
+      return sizeof(parallel_value);
+    case io_kind::async_dlopen:
+      return sizeof(async_dlopen_value);
+    case io_kind::await:
+      return sizeof(await_value);
+    case io_kind::effect:
+      return sizeof(effect_value);
+  }
+  return sizeof(io_value);
+}
+
+static unsigned long nodes_run[io_kinds];
+
+void for_each_io_count(const std::function<void(const char *, unsigned long)> & f) {
+  for (size_t i = 0; i < io_kinds; ++i)
+    f(kind_name(static_cast<io_kind>(i)), nodes_run[i]);
+}
+
+/* Measures the already-forced part of an IO graph without forcing anything.
+ * Memory reachable from several nodes is charged to whichever one the walk
+ * reaches first, so every byte is counted exactly once.
+ */
+class io_stats {
+  struct totals {
+    size_t nodes = 0;
+    size_t bytes = 0;
   };
 
-  void run(EvalState & state, fn_stack & fns, Value & v) override {
-    auto & arg = *state.allocValue();
-    {
-      auto ctx = nix::PathSet{};
-      auto filename = state.coerceToString( pos
-                                          , filename_val
-                                          , ctx
-                                          , false
-                                          , false
-					  );
-      try {
-        state.realiseContext(ctx);
-      } catch (nix::InvalidPathError & e) {
-        throw nix::EvalError(format("cannot dlopen `%1%', since path `%2%' is not valid, at %3%")
-          % filename % e.path % pos);
-      }
+  std::unordered_set<const void *> seen;
+  std::vector<Value *> values;
+  std::vector<nix::Env *> envs;
+  std::vector<io_value *> nodes;
 
-      auto handle = ::dlopen(filename.c_str(), RTLD_LAZY | RTLD_LOCAL);
-      if (!handle)
-        throw nix::EvalError(format("could not open `%1%': %2%") % filename % ::dlerror());
+  totals kinds[io_kinds];
+  std::unordered_map<const Pos *, totals> positions;
 
-      auto symbol = state.forceStringNoCtx(symbol_val, pos);
-      ::dlerror();
-      nix::PrimOpFun fn = (nix::PrimOpFun) ::dlsym(handle, symbol.c_str());
-      auto err = ::dlerror();
-      if (err)
-        throw nix::EvalError(format("could not load symbol `%1%' from `%2%': %3%") % symbol % filename % err);
+  void add(Value * v) {
+    if (v && seen.insert(v).second)
+      values.push_back(v);
+  };
 
-      state.forceList(args, pos);
-      fn(state, pos, args.listElems(), arg);
-    }
-    if (fns.empty()) {
-      v = arg;
-    } else {
-      return apply_fns(state, fns, &arg, v);
-    }
+  void add(nix::Env * env) {
+    if (env && seen.insert(env).second)
+      envs.push_back(env);
   };
 
-  size_t valueSize(std::set<const void *> & seen) const override {
-    auto res = sizeof *this;
-    if (seen.find(&filename_val) == seen.end()) {
-      seen.insert(&filename_val);
-      res += nix::valueSize(filename_val);
-    }
-    if (seen.find(&symbol_val) == seen.end()) {
-      seen.insert(&symbol_val);
-      res += nix::valueSize(symbol_val);
-    }
-    if (seen.find(&args) == seen.end()) {
-      seen.insert(&args);
-      res += nix::valueSize(args);
-    }
-    if (seen.find(&pos) == seen.end()) {
-      seen.insert(&pos);
-      res += sizeof pos;
+  /* Sizes everything queued that isn't an IO node, queueing the nodes */
+  size_t drain() {
+    size_t res = 0;
+    while (!values.empty() || !envs.empty()) {
+      if (!envs.empty()) {
+        auto & env = *envs.back();
+        envs.pop_back();
+        res += sizeof env + env.size * sizeof(Value *);
+        add(env.up);
+        if (env.type != nix::Env::HasWithExpr)
+          for (size_t i = 0; i < env.size; ++i)
+            add(env.values[i]);
+        continue;
+      }
+
+      auto & v = *values.back();
+      values.pop_back();
+      res += sizeof v;
+      switch (v.type) {
+        case nix::tString:
+          res += strlen(v.string.s) + 1;
+          if (v.string.context)
+            for (auto ctx = v.string.context; *ctx; ++ctx)
+              res += sizeof *ctx + strlen(*ctx) + 1;
+          break;
+        case nix::tPath:
+          res += strlen(v.path) + 1;
+          break;
+        case nix::tAttrs:
+          if (seen.insert(v.attrs).second) {
+            res += sizeof *v.attrs + v.attrs->size() * sizeof(nix::Attr);
+            for (auto & attr : *v.attrs)
+              add(attr.value);
+          }
+          break;
+        case nix::tList1:
+        case nix::tList2:
+        case nix::tListN:
+          if (v.type == nix::tListN && seen.insert(v.listElems()).second)
+            res += v.listSize() * sizeof(Value *);
+          for (size_t i = 0; i < v.listSize(); ++i)
+            add(v.listElems()[i]);
+          break;
+        case nix::tThunk:
+          add(v.thunk.env);
+          break;
+        case nix::tApp:
+          add(v.app.left);
+          add(v.app.right);
+          break;
+        case nix::tLambda:
+          add(v.lambda.env);
+          break;
+        case nix::tPrimOpApp:
+          add(v.primOpApp.left);
+          add(v.primOpApp.right);
+          break;
+        case nix::tExternal: {
+          auto node = as_io_value(*v.external);
+          if (node) {
+            if (seen.insert(node).second)
+              nodes.push_back(node);
+          } else {
+            std::set<const void *> ext_seen;
+            res += v.external->valueSize(ext_seen);
+          }
+          break;
+        }
+        default:
+          break;
+      }
     }
     return res;
   };
 
   public:
-  dlopen_value( Value & filename_val
-              , Value & symbol_val
-              , Value & args
-              , const Pos & pos
-              ) :
-    filename_val(filename_val), symbol_val(symbol_val), args(args), pos(pos) {};
+  void walk(Value & root) {
+    add(&root);
+    drain();
+    while (!nodes.empty()) {
+      auto & node = *nodes.back();
+      nodes.pop_back();
+      io_graph::for_each_value(node, [&] (Value & v) { add(&v); });
+      auto bytes = node_size(node.kind) + drain();
+
+      auto & kind = kinds[static_cast<size_t>(node.kind)];
+      ++kind.nodes;
+      kind.bytes += bytes;
+      auto & pos = positions[io_graph::pos_of(node)];
+      ++pos.nodes;
+      pos.bytes += bytes;
+    }
+  };
+
+  void print(std::ostream & out, size_t top) const {
+    auto total = totals{};
+    out << format("%|-12| %|12| %|16|\n") % "kind" % "nodes" % "bytes";
+    for (size_t i = 0; i < io_kinds; ++i) {
+      if (!kinds[i].nodes)
+        continue;
+      out << format("%|-12| %|12| %|16|\n")
+        % kind_name(static_cast<io_kind>(i))
+        % kinds[i].nodes
+        % kinds[i].bytes;
+      total.nodes += kinds[i].nodes;
+      total.bytes += kinds[i].bytes;
+    }
+    out << format("%|-12| %|12| %|16|\n") % "total" % total.nodes % total.bytes;
+
+    auto by_size = std::vector<std::pair<const Pos *, totals>>{
+      positions.begin(), positions.end()
+    };
+    std::sort(by_size.begin(), by_size.end(), [] (
+        const std::pair<const Pos *, totals> & a
+      , const std::pair<const Pos *, totals> & b
+      ) {
+      return a.second.bytes > b.second.bytes;
+    });
+    if (by_size.size() > top)
+      by_size.resize(top);
+
+    out << "\n" << format("%|16| %|12|  %s\n") % "bytes" % "nodes" % "position";
+    for (auto & pos : by_size) {
+      out << format("%|16| %|12|  ") % pos.second.bytes % pos.second.nodes;
+      if (pos.first)
+        out << *pos.first << "\n";
+      else
+        out << "(unit values)\n";
+    }
+  };
 };
 
+void print_io_stats(Value & v, std::ostream & out) {
+  auto stats = io_stats{};
+  stats.walk(v);
+  stats.print(out, 20);
+}
+
 void run_io(EvalState & state, Value & arg, const Pos & pos, Value & v) {
-  fn_stack fns;
-  return force_io_value(state, arg, pos).run(state, fns, v);
+  frame_stack fns;
+  fns.reserve(initial_frames);
+  /* The frame just popped to return through, if any, so errors can name it.
+   * List frames stay on the stack while they step, so they never need this.
+   */
+  auto returning = frame{};
+
+  try {
+    auto node = &force_io_value(state, arg, pos);
+    /* Once per program, since the pass walks everything it can reach */
+    if (optimize_io) {
+      io_graph::optimize(state, arg);
+      node = static_cast<io_value *>(arg.external);
+    }
+    while (true) {
+      Value * res;
+      ++nodes_run[static_cast<size_t>(node->kind)];
+      switch (node->kind) {
+        case io_kind::unit:
+          res = &static_cast<unit_value *>(node)->a;
+          break;
+        case io_kind::map: {
+          auto & m = *static_cast<map_value *>(node);
+          if (m.fused) {
+            /* The first function applied is pushed last */
+            for (auto i = m.f.listSize(); i-- > 0;) {
+              auto & fn = *m.f.listElems()[i];
+              state.forceFunction(fn, m.pos);
+              fns.push_back(frame{frame_kind::apply, &m.pos, node, &fn, nullptr, 0});
+            }
+          } else {
+            state.forceFunction(m.f, m.pos);
+            fns.push_back(frame{frame_kind::apply, &m.pos, node, &m.f, nullptr, 0});
+          }
+          node = &force_io_value(state, m.ma_val, m.pos);
+          continue;
+        }
+        case io_kind::join: {
+          auto & j = *static_cast<join_value *>(node);
+          node = &force_io_value(state, j.mma_val, j.pos);
+          fns.push_back(frame{frame_kind::run, &j.pos, &j, nullptr, nullptr, 0});
+          continue;
+        }
+        case io_kind::bind: {
+          auto & b = *static_cast<bind_value *>(node);
+          state.forceFunction(b.f, b.pos);
+          fns.push_back(frame{frame_kind::bind, &b.pos, node, &b.f, nullptr, 0});
+          node = &force_io_value(state, b.ma_val, b.pos);
+          continue;
+        }
+        case io_kind::then: {
+          auto & t = *static_cast<then_value *>(node);
+          fns.push_back(frame{frame_kind::then, &t.pos, node, nullptr, nullptr, 0});
+          node = &force_io_value(state, t.ma_val, t.pos);
+          continue;
+        }
+        case io_kind::sequence: {
+          auto & s = *static_cast<sequence_value *>(node);
+          state.forceList(s.list, s.pos);
+          auto size = s.list.listSize();
+          res = state.allocValue();
+          state.mkList(*res, size);
+          if (size == 0)
+            break;
+          fns.push_back(frame{frame_kind::sequence, &s.pos, node, nullptr, res, 0});
+          node = &force_io_value(state, *s.list.listElems()[0], s.pos);
+          continue;
+        }
+        case io_kind::traverse: {
+          auto & t = *static_cast<traverse_value *>(node);
+          state.forceFunction(t.f, t.pos);
+          state.forceList(t.list, t.pos);
+          auto size = t.list.listSize();
+          res = state.allocValue();
+          state.mkList(*res, size);
+          if (size == 0)
+            break;
+          fns.push_back(frame{frame_kind::traverse, &t.pos, node, &t.f, res, 0});
+          auto & mb = apply(state, t.f, *t.list.listElems()[0], t.pos);
+          node = &force_io_value(state, mb, t.pos);
+          continue;
+        }
+        case io_kind::foldm: {
+          auto & fm = *static_cast<foldm_value *>(node);
+          state.forceFunction(fm.f, fm.pos);
+          state.forceList(fm.list, fm.pos);
+          if (fm.list.listSize() == 0) {
+            res = &fm.z;
+            break;
+          }
+          fns.push_back(frame{frame_kind::fold, &fm.pos, node, &fm.f, &fm.z, 0});
+          auto & step = apply(state, fm.f, fm.z, fm.pos);
+          auto & mb = apply(state, step, *fm.list.listElems()[0], fm.pos);
+          node = &force_io_value(state, mb, fm.pos);
+          continue;
+        }
+        case io_kind::dlopen:
+          res = state.allocValue();
+          static_cast<dlopen_value *>(node)->call(state, *res);
+          break;
+        case io_kind::realise:
+          res = state.allocValue();
+          static_cast<realise_value *>(node)->call(state, *res);
+          break;
+        case io_kind::parallel:
+          res = state.allocValue();
+          static_cast<parallel_value *>(node)->call(state, *res);
+          break;
+        case io_kind::async_dlopen:
+          res = state.allocValue();
+          static_cast<async_dlopen_value *>(node)->call(state, *res);
+          break;
+        case io_kind::await:
+          res = state.allocValue();
+          static_cast<await_value *>(node)->call(state, *res);
+          break;
+        case io_kind::effect:
+          res = state.allocValue();
+          static_cast<effect_value *>(node)->perform(state, *res);
+          break;
+      }
+
+      node = nullptr;
+      while (!node && !fns.empty()) {
+        auto & top = fns.back();
+        switch (top.kind) {
+          case frame_kind::apply:
+            returning = top;
+            pop_frame(fns);
+            res = &apply(state, *returning.fun, *res, *returning.pos);
+            break;
+          case frame_kind::run:
+            returning = top;
+            pop_frame(fns);
+            node = &force_io_value(state, *res, *returning.pos);
+            break;
+          case frame_kind::bind: {
+            returning = top;
+            pop_frame(fns);
+            auto & mb = apply(state, *returning.fun, *res, *returning.pos);
+            node = &force_io_value(state, mb, *returning.pos);
+            break;
+          }
+          case frame_kind::then:
+            returning = top;
+            pop_frame(fns);
+            node = &force_io_value( state
+                                  , static_cast<then_value *>(returning.node)->mb_val
+                                  , *returning.pos
+                                  );
+            break;
+          case frame_kind::sequence: {
+            auto & list = static_cast<sequence_value *>(top.node)->list;
+            top.acc->listElems()[top.index] = res;
+            if (++top.index == list.listSize()) {
+              res = top.acc;
+              pop_frame(fns);
+            } else
+              node = &force_io_value(state, *list.listElems()[top.index], *top.pos);
+            break;
+          }
+          case frame_kind::traverse: {
+            auto & list = static_cast<traverse_value *>(top.node)->list;
+            top.acc->listElems()[top.index] = res;
+            if (++top.index == list.listSize()) {
+              res = top.acc;
+              pop_frame(fns);
+            } else {
+              auto & mb = apply(state, *top.fun, *list.listElems()[top.index], *top.pos);
+              node = &force_io_value(state, mb, *top.pos);
+            }
+            break;
+          }
+          case frame_kind::fold: {
+            auto & list = static_cast<foldm_value *>(top.node)->list;
+            top.acc = res;
+            if (++top.index == list.listSize()) {
+              pop_frame(fns);
+            } else {
+              auto & step = apply(state, *top.fun, *top.acc, *top.pos);
+              auto & mb = apply(state, step, *list.listElems()[top.index], *top.pos);
+              node = &force_io_value(state, mb, *top.pos);
+            }
+            break;
+          }
+        }
+      }
+      returning = frame{};
+
+      if (!node) {
+        state.forceValue(*res);
+        v = *res;
+        return;
+      }
+    }
+  } catch (nix::Error & e) {
+    /* The continuation stack already records where the interpreter is, so
+     * describing it here costs nothing until an error actually escapes.
+     */
+    auto elide = !nix::settings.showTrace && fns.size() > 2 * context_frames;
+    if (returning.node)
+      add_context(e, returning);
+    for (auto f = fns.rbegin(); f != fns.rend(); ++f) {
+      auto depth = f - fns.rbegin();
+      if (elide && depth == context_frames) {
+        e.addPrefix( format("(%1% more frames, use --show-trace to see them)\n")
+                   % (fns.size() - 2 * context_frames)
+                   );
+        f += fns.size() - 2 * context_frames - 1;
+        continue;
+      }
+      add_context(e, *f);
+    }
+    throw;
+  }
 }
 
 static void unit(EvalState & state, const Pos & pos, Value ** args, Value & v) {
@@ -338,6 +1838,39 @@ static void map(EvalState & state, const Pos & pos, Value ** args, Value & v) {
   v.external = NEW map_value(*args[0], *args[1], pos);
 }
 
+static void bind(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW bind_value(*args[0], *args[1], pos);
+}
+
+static void then(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW then_value(*args[0], *args[1], pos);
+}
+
+static void sequence( EvalState & state
+                    , const Pos & pos
+                    , Value ** args
+                    , Value & v
+                    ) {
+  v.type = nix::tExternal;
+  v.external = NEW sequence_value(*args[0], pos);
+}
+
+static void traverse( EvalState & state
+                    , const Pos & pos
+                    , Value ** args
+                    , Value & v
+                    ) {
+  v.type = nix::tExternal;
+  v.external = NEW traverse_value(*args[0], *args[1], pos);
+}
+
+static void foldm(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW foldm_value(*args[0], *args[1], *args[2], pos);
+}
+
 static void prim_dlopen( EvalState & state
                        , const Pos & pos
                        , Value ** args
@@ -517,45 +2050,197 @@ static void unsafe( EvalState & state
   run_io(state, *args[0], pos, v);
 }
 
-static void setup_builtins(EvalState & state, Value & dlopen_prim, Value & v) {
-  state.mkAttrs(v, 3);
+/* The plugins installed with nix-exec, called directly rather than through
+ * an expression that applies dlopen, so there's nothing to parse at startup
+ */
+static void plugin_call( EvalState & state
+                       , const char * filename
+                       , const char * symbol
+                       , Value & arg
+                       , const Pos & pos
+                       , Value & v
+                       ) {
+  auto & filename_val = *state.allocValue();
+  nix::mkStringNoCopy(filename_val, filename);
+
+  auto & symbol_val = *state.allocValue();
+  nix::mkStringNoCopy(symbol_val, symbol);
+
+  auto & args = *state.allocValue();
+  state.mkList(args, 1);
+  args.listElems()[0] = &arg;
+
+  v.type = nix::tExternal;
+  v.external = NEW dlopen_value(filename_val, symbol_val, args, pos);
+}
+
+static void prim_async_dlopen( EvalState & state
+                             , const Pos & pos
+                             , Value ** args
+                             , Value & v
+                             ) {
+  v.type = nix::tExternal;
+  v.external = NEW async_dlopen_value(*args[0], *args[1], *args[2], pos);
+}
+
+static void prim_await( EvalState & state
+                      , const Pos & pos
+                      , Value ** args
+                      , Value & v
+                      ) {
+  v.type = nix::tExternal;
+  v.external = NEW await_value(*args[0], pos);
+}
+
+static void prim_parallel( EvalState & state
+                         , const Pos & pos
+                         , Value ** args
+                         , Value & v
+                         ) {
+  v.type = nix::tExternal;
+  v.external = NEW parallel_value(*args[0], *args[1], pos);
+}
+
+static void prim_realise( EvalState & state
+                        , const Pos & pos
+                        , Value ** args
+                        , Value & v
+                        ) {
+  v.type = nix::tExternal;
+  v.external = NEW realise_value(*args[0], pos);
+}
+
+static void fetchgit( EvalState & state
+                    , const Pos & pos
+                    , Value ** args
+                    , Value & v
+                    ) {
+  plugin_call( state
+             , NIXEXEC_PLUGIN_DIR "/libfetchgit" SHREXT
+             , "fetchgit"
+             , *args[0]
+             , pos
+             , v
+             );
+}
+
+static void reexec( EvalState & state
+                  , const Pos & pos
+                  , Value ** args
+                  , Value & v
+                  ) {
+  plugin_call( state
+             , NIXEXEC_PLUGIN_DIR "/libreexec" SHREXT
+             , "reexec"
+             , *args[0]
+             , pos
+             , v
+             );
+}
+
+static void setup_builtins(EvalState & state, Value & v) {
+  state.mkAttrs(v, 9);
 
   auto unsafe_sym = state.symbols.create("unsafe-perform-io");
   auto & unsafe_perform_io = *state.allocAttr(v, unsafe_sym);
   unsafe_perform_io.type = nix::tPrimOp;
   unsafe_perform_io.primOp = NEW nix::PrimOp(unsafe, 1, unsafe_sym);
 
-  auto fetchgit_expr = state.parseExprFromString( "dlopen: spec: dlopen \""
-                                                  NIXEXEC_PLUGIN_DIR
-                                                  "/libfetchgit"
-                                                  SHREXT
-                                                  "\" \"fetchgit\" [ spec ]"
-                                                , __FILE__
-                                                );
-  auto & fetchgit_fun = *state.allocValue();
-  state.eval(fetchgit_expr, fetchgit_fun);
-  auto & fetchgit = *state.allocAttr(v, state.symbols.create("fetchgit"));
-  state.callFunction(fetchgit_fun, dlopen_prim, fetchgit, Pos{});
-
-  auto reexec_expr = state.parseExprFromString( "dlopen: path: dlopen \""
-                                                 NIXEXEC_PLUGIN_DIR
-                                                 "/libreexec"
-                                                 SHREXT
-                                                 "\" \"reexec\" [ path ]"
-                                              , __FILE__
-                                              );
-  auto & reexec_fun = *state.allocValue();
-  state.eval(reexec_expr, reexec_fun);
-  auto & reexec = *state.allocAttr(v, state.symbols.create("reexec"));
-  state.callFunction(reexec_fun, dlopen_prim, reexec, Pos{});
+  auto fetchgit_sym = state.symbols.create("fetchgit");
+  auto & fetchgit_prim = *state.allocAttr(v, fetchgit_sym);
+  fetchgit_prim.type = nix::tPrimOp;
+  fetchgit_prim.primOp = NEW nix::PrimOp(fetchgit, 1, fetchgit_sym);
+
+  auto reexec_sym = state.symbols.create("reexec");
+  auto & reexec_prim = *state.allocAttr(v, reexec_sym);
+  reexec_prim.type = nix::tPrimOp;
+  reexec_prim.primOp = NEW nix::PrimOp(reexec, 1, reexec_sym);
+
+  auto realise_sym = state.symbols.create("realise");
+  auto & realise_prim = *state.allocAttr(v, realise_sym);
+  realise_prim.type = nix::tPrimOp;
+  realise_prim.primOp = NEW nix::PrimOp(prim_realise, 1, realise_sym);
+
+  auto exec_sym = state.symbols.create("exec");
+  auto & exec_prim = *state.allocAttr(v, exec_sym);
+  exec_prim.type = nix::tPrimOp;
+  exec_prim.primOp = NEW nix::PrimOp(prim_exec, 1, exec_sym);
+
+  auto spawn_sym = state.symbols.create("spawn");
+  auto & spawn_prim = *state.allocAttr(v, spawn_sym);
+  spawn_prim.type = nix::tPrimOp;
+  spawn_prim.primOp = NEW nix::PrimOp(prim_spawn, 1, spawn_sym);
+
+  auto wait_sym = state.symbols.create("wait");
+  auto & wait_prim = *state.allocAttr(v, wait_sym);
+  wait_prim.type = nix::tPrimOp;
+  wait_prim.primOp = NEW nix::PrimOp(prim_wait, 1, wait_sym);
+
+  auto read_sym = state.symbols.create("read");
+  auto & read_prim = *state.allocAttr(v, read_sym);
+  read_prim.type = nix::tPrimOp;
+  read_prim.primOp = NEW nix::PrimOp(prim_read, 1, read_sym);
+
+  auto wait_any_sym = state.symbols.create("wait-any");
+  auto & wait_any_prim = *state.allocAttr(v, wait_any_sym);
+  wait_any_prim.type = nix::tPrimOp;
+  wait_any_prim.primOp = NEW nix::PrimOp(prim_wait_any, 1, wait_any_sym);
 
   v.attrs->sort();
 }
 
+static void lazy_config( EvalState & state
+                       , const Pos & pos
+                       , Value ** args
+                       , Value & v
+                       ) {
+  setup_config(state, v);
+}
+
+static void lazy_builtins( EvalState & state
+                         , const Pos & pos
+                         , Value ** args
+                         , Value & v
+                         ) {
+  setup_builtins(state, v);
+}
+
+/* Makes v an application of setup, so the set is only built if the program
+ * looks at it.
+ */
+static void setup_lazy( EvalState & state
+                      , const char * name
+                      , nix::PrimOpFun setup
+                      , Value & v
+                      ) {
+  auto & setup_prim = *state.allocValue();
+  setup_prim.type = nix::tPrimOp;
+  setup_prim.primOp = NEW nix::PrimOp(setup, 1, state.symbols.create(name));
+
+  auto & unused = *state.allocValue();
+  nix::mkNull(unused);
+
+  nix::mkApp(v, setup_prim, unused);
+}
+
+/* The lib last built, since unsafe-lib.nix may be imported through many
+ * paths in one evaluation. It is keyed on the state's base environment
+ * rather than the state: statics are scanned by the collector, so holding
+ * the Env keeps it alive and no later EvalState can get its address.
+ */
+static nix::Env * lib_env = nullptr;
+static Value * lib_value = nullptr;
+
 extern "C" void setup_lib(EvalState & state, Value & v) {
-  state.mkAttrs(v, 6);
+  if (lib_env == &state.baseEnv) {
+    v = *lib_value;
+    return;
+  }
 
   auto unit_sym = state.symbols.create("unit");
+
+  state.mkAttrs(v, 14);
+
   auto & unit_prim = *state.allocAttr(v, unit_sym);
   unit_prim.type = nix::tPrimOp;
   unit_prim.primOp = NEW nix::PrimOp(unit, 1, unit_sym);
@@ -570,16 +2255,60 @@ extern "C" void setup_lib(EvalState & state, Value & v) {
   map_prim.type = nix::tPrimOp;
   map_prim.primOp = NEW nix::PrimOp(map, 2, map_sym);
 
+  auto bind_sym = state.symbols.create("bind");
+  auto & bind_prim = *state.allocAttr(v, bind_sym);
+  bind_prim.type = nix::tPrimOp;
+  bind_prim.primOp = NEW nix::PrimOp(bind, 2, bind_sym);
+
+  auto then_sym = state.symbols.create("then'");
+  auto & then_prim = *state.allocAttr(v, then_sym);
+  then_prim.type = nix::tPrimOp;
+  then_prim.primOp = NEW nix::PrimOp(then, 2, then_sym);
+
+  auto sequence_sym = state.symbols.create("sequence");
+  auto & sequence_prim = *state.allocAttr(v, sequence_sym);
+  sequence_prim.type = nix::tPrimOp;
+  sequence_prim.primOp = NEW nix::PrimOp(sequence, 1, sequence_sym);
+
+  auto traverse_sym = state.symbols.create("traverse");
+  auto & traverse_prim = *state.allocAttr(v, traverse_sym);
+  traverse_prim.type = nix::tPrimOp;
+  traverse_prim.primOp = NEW nix::PrimOp(traverse, 2, traverse_sym);
+
+  auto foldm_sym = state.symbols.create("foldM");
+  auto & foldm_prim = *state.allocAttr(v, foldm_sym);
+  foldm_prim.type = nix::tPrimOp;
+  foldm_prim.primOp = NEW nix::PrimOp(foldm, 3, foldm_sym);
+
   auto dlopen_sym = state.symbols.create("dlopen");
   auto & dlopen_prim = *state.allocAttr(v, dlopen_sym);
   dlopen_prim.type = nix::tPrimOp;
   dlopen_prim.primOp = NEW nix::PrimOp(prim_dlopen, 3, dlopen_sym);
 
+  auto parallel_sym = state.symbols.create("parallel");
+  auto & parallel_prim = *state.allocAttr(v, parallel_sym);
+  parallel_prim.type = nix::tPrimOp;
+  parallel_prim.primOp = NEW nix::PrimOp(prim_parallel, 2, parallel_sym);
+
+  auto async_dlopen_sym = state.symbols.create("async-dlopen");
+  auto & async_dlopen_prim = *state.allocAttr(v, async_dlopen_sym);
+  async_dlopen_prim.type = nix::tPrimOp;
+  async_dlopen_prim.primOp = NEW nix::PrimOp(prim_async_dlopen, 3, async_dlopen_sym);
+
+  auto await_sym = state.symbols.create("await");
+  auto & await_prim = *state.allocAttr(v, await_sym);
+  await_prim.type = nix::tPrimOp;
+  await_prim.primOp = NEW nix::PrimOp(prim_await, 1, await_sym);
+
   auto & config = *state.allocAttr(v, state.symbols.create("configuration"));
-  setup_config(state, config);
+  setup_lazy(state, "configuration", lazy_config, config);
 
   auto & builtins = *state.allocAttr(v, state.symbols.create("builtins"));
-  setup_builtins(state, dlopen_prim, builtins);
+  setup_lazy(state, "builtins", lazy_builtins, builtins);
 
   v.attrs->sort();
+
+  lib_env = &state.baseEnv;
+  lib_value = state.allocValue();
+  *lib_value = v;
 }
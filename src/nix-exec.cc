@@ -1,4 +1,10 @@
 #include <iostream>
+#include <fstream>
+#include <chrono>
+#include <exception>
+extern "C" {
+#include <sys/resource.h>
+}
 
 /* Work around nix's config.h */
 #undef PACKAGE_NAME
@@ -10,7 +16,15 @@
 #include <store-api.hh>
 #include <globals.hh>
 
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
 #include "nix-exec.hh"
+#include "trace.hh"
+#include "server.hh"
+#include "expr-cache.hh"
+#include "reexec-cache.hh"
 
 static void setup_args(nix::EvalState & state, nix::Value & args, nix::Strings::difference_type arg_count) {
   state.mkList(args, arg_count);
@@ -24,21 +38,183 @@ static void setup_args(nix::EvalState & state, nix::Value & args, nix::Strings::
   } while (--arg_count);
 }
 
+typedef std::chrono::steady_clock steady_clock;
+
+static double seconds_since(steady_clock::time_point start) {
+  return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+/* Written by --stats-json when nix-exec finishes, whether or not it succeeds */
+struct run_stats {
+  const nix::Path & path;
+  nix::EvalState & state;
+  double parse = 0;
+  double eval = 0;
+  double run = 0;
+
+  run_stats(const nix::Path & path, nix::EvalState & state) :
+    path(path), state(state) {};
+
+  ~run_stats() {
+    if (path.empty())
+      return;
+    try {
+      write();
+    } catch (std::exception & e) {
+      std::cerr << "warning: writing statistics to `" << path << "': "
+                << e.what() << std::endl;
+    }
+  };
+
+  void write() const {
+    std::ofstream out;
+    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    out.open(path);
+
+    out << "{\"success\":" << (std::uncaught_exception() ? "false" : "true")
+        << ",\"time\":{\"parse\":" << parse
+        << ",\"eval\":" << eval
+        << ",\"run\":" << run
+        << "},\"evaluator\":{\"symbols\":" << state.symbols.size()
+        << "}";
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      out << ",\"memory\":{\"peakRSS\":" << usage.ru_maxrss << "}";
+
+#if HAVE_BOEHMGC
+    out << ",\"gc\":{\"heapSize\":" << GC_get_heap_size()
+        << ",\"totalBytes\":" << GC_get_total_bytes()
+        << ",\"collections\":" << GC_get_gc_no()
+        << "}";
+#endif
+
+    out << ",\"io\":{\"nodes\":{";
+    auto first = true;
+    for_each_io_count([&] (const char * kind, unsigned long count) {
+      out << (first ? "" : ",") << "\"" << kind << "\":" << count;
+      first = false;
+    });
+    out << "},\"dlopen\":{\"calls\":"
+        << nixexec_dlopen_cache_hits + nixexec_dlopen_cache_misses
+        << ",\"cacheHits\":" << nixexec_dlopen_cache_hits
+        << ",\"cacheMisses\":" << nixexec_dlopen_cache_misses
+        << "},\"realisations\":" << nixexec_store_realisations
+        << ",\"fetchgit\":{\"cacheHits\":" << nixexec_fetchgit_cache_hits
+        << ",\"cacheMisses\":" << nixexec_fetchgit_cache_misses
+        << "}},\"parseCache\":{\"hits\":" << expr_cache_hits
+        << ",\"misses\":" << expr_cache_misses
+        << "}}" << std::endl;
+  };
+};
+
+struct run_options {
+  bool io_stats = false;
+  nix::Path stats_path;
+};
+
+/* Evaluates and runs the script named by the last arg_count arguments. expr
+ * is the script if it's already been parsed, or nullptr.
+ */
+static void run_script( nix::EvalState & state
+                      , nix::Value & lib
+                      , nix::Expr * expr
+                      , nix::Strings::difference_type arg_count
+                      , const run_options & options
+                      ) {
+  trace_span span;
+  auto stats = run_stats{options.stats_path, state};
+
+  auto expr_path = nixexec_argv[nixexec_argc - arg_count];
+
+  auto start = steady_clock::now();
+  if (!expr) {
+    span.begin("startup", "parse");
+    span.arg("file", expr_path);
+    expr = parse_file(state, nix::lookupFileArg(state, expr_path));
+    span.end();
+  }
+  stats.parse = seconds_since(start);
+
+  start = steady_clock::now();
+  span.begin("startup", "eval");
+  auto & fn = *state.allocValue();
+
+  state.eval(expr, fn);
+
+  auto top_pos = nix::Pos{state.symbols.create(expr_path), 1, 1};
+
+  state.forceFunction(fn, top_pos);
+
+  auto & fn_args = *state.allocValue();
+
+  state.mkAttrs(fn_args, 2);
+
+  auto & args = *state.allocAttr(fn_args, state.symbols.create("args"));
+  setup_args(state, args, arg_count);
+
+  *state.allocAttr(fn_args, state.symbols.create("lib")) = lib;
+
+  fn_args.attrs->sort();
+
+  auto & result = *state.allocValue();
+  state.callFunction(fn, fn_args, result, top_pos);
+
+  auto & fn_pos = fn.type == nix::tLambda
+    ? fn.lambda.fun->pos
+    : top_pos;
+  span.end();
+  stats.eval = seconds_since(start);
+
+  if (options.io_stats)
+    print_io_stats(result, std::cerr);
+
+  start = steady_clock::now();
+  span.begin("run", "run_io");
+  nix::Value v;
+  try {
+    run_io(state, result, fn_pos, v);
+  } catch (...) {
+    stats.run = seconds_since(start);
+    throw;
+  }
+  stats.run = seconds_since(start);
+}
+
 static void run() {
   nix::initNix();
   nix::initGC();
 
   auto search_path = nix::Strings{};
   auto arg_count = nix::Strings::difference_type{0};
+  auto options = run_options{};
+  auto server_path = nix::Path{};
 
   nix::parseCmdLine(nixexec_argc, nixexec_argv,
       [&] (nix::Strings::iterator & arg, const nix::Strings::iterator & end) {
     if (*arg == "--help" || *arg == "-h") {
       std::cerr << "Usage: " << nixexec_argv[0] << " FILE ARGS..." << std::endl;
+      std::cerr << "       " << nixexec_argv[0] << " --server SOCKET" << std::endl;
       throw nix::Exit();
     } else if (*arg == "--version") {
       std::cout << nixexec_argv[0] << " " VERSION " (Nix " << nix::nixVersion << ")" << std::endl;
       throw nix::Exit();
+    } else if (*arg == "--optimize-io") {
+      optimize_io = true;
+      return true;
+    } else if (*arg == "--io-stats") {
+      options.io_stats = true;
+      return true;
+    } else if (*arg == "--stats-json") {
+      if (++arg == end)
+        throw nix::UsageError("`--stats-json' requires an argument");
+      options.stats_path = nix::absPath(*arg);
+      return true;
+    } else if (*arg == "--server") {
+      if (++arg == end)
+        throw nix::UsageError("`--server' requires an argument");
+      server_path = nix::absPath(*arg);
+      return true;
     } else if (nix::parseSearchPathArg(arg, end, search_path)) {
       return true;
     }
@@ -55,48 +231,64 @@ static void run() {
     return true;
   });
 
-  if (arg_count == 0)
+  if (arg_count == 0 && server_path.empty())
     throw nix::UsageError("No file given");
+  /* Every request would write over the same file */
+  if (!server_path.empty() && !options.stats_path.empty())
+    throw nix::UsageError("`--stats-json' can't be used with `--server'");
 
-  auto store = nix::openStore();
-  auto state = nix::EvalState{search_path, store};
-
-  auto expr_path = nixexec_argv[nixexec_argc - arg_count];
-
-  auto expr = state.parseExprFromFile(nix::lookupFileArg(state, expr_path));
-
-  auto & fn = *state.allocValue();
-
-  state.eval(expr, fn);
-
-  auto top_pos = nix::Pos{state.symbols.create(expr_path), 1, 1};
+  auto trace_path = getenv("NIX_EXEC_TRACE_FILE");
+  if (trace_path)
+    trace_open(trace_path);
 
-  state.forceFunction(fn, top_pos);
-
-  auto & fn_args = *state.allocValue();
+  trace_span span;
+  span.begin("startup", "openStore");
+  auto store = nix::openStore();
+  span.end();
 
-  state.mkAttrs(fn_args, 2);
+  span.begin("startup", "EvalState");
+  auto state = nix::EvalState{search_path, store};
+  span.end();
 
-  auto & args = *state.allocAttr(fn_args, state.symbols.create("args"));
-  setup_args(state, args, arg_count);
+  auto cache_dir = getenv("NIX_EXEC_PARSE_CACHE");
+  if (cache_dir && *cache_dir)
+    expr_cache_open(state, nix::absPath(cache_dir));
+  if (reexec_cache_recording())
+    reexec_cache_track(state);
 
-  auto & lib = *state.allocAttr(fn_args, state.symbols.create("lib"));
+  auto & lib = *state.allocValue();
   setup_lib(state, lib);
 
-  fn_args.attrs->sort();
-
-  auto & result = *state.allocValue();
-  state.callFunction(fn, fn_args, result, top_pos);
+  if (!server_path.empty()) {
+    serve(state, server_path.c_str(), [&] (nix::Expr * expr) {
+      /* Requests are always FILE ARGS... */
+      run_script(state, lib, expr, nixexec_argc - 1, options);
+    });
+    return;
+  }
 
-  auto & fn_pos = fn.type == nix::tLambda
-    ? fn.lambda.fun->pos
-    : top_pos;
-  nix::Value v;
-  run_io(state, result, fn_pos, v);
+  run_script(state, lib, nullptr, arg_count, options);
 }
 
 int main(int argc, char ** argv) {
   nixexec_argc = argc;
   nixexec_argv = argv;
+
+  auto is_plain = argc > 1 && argv[1][0] != '-';
+
+  auto reexec_cache = getenv("NIX_EXEC_REEXEC_CACHE");
+  if (reexec_cache && *reexec_cache && is_plain)
+    reexec_cache_exec(reexec_cache);
+
+  /* Hand plain `nix-exec FILE ARGS...' invocations to a running server, if
+   * there is one, before paying for any startup of our own.
+   */
+  auto server_path = getenv("NIX_EXEC_SERVER");
+  if (server_path && *server_path && is_plain) {
+    auto status = run_client(server_path, argc, argv);
+    if (status != -1)
+      return status;
+  }
+
   return nix::handleExceptions(argv[0], run);
 }
@@ -1,3 +1,6 @@
+#include <iosfwd>
+#include <functional>
+
 extern "C" {
 #include "nix-exec.h"
 }
@@ -8,10 +11,26 @@ namespace nix {
   struct Pos;
 }
 
+/* Whether to rewrite IO programs using the monad laws before running them */
+extern bool optimize_io;
+
+/* Calls f with the name of each kind of IO node and the number of them
+ * run_io has run in this process
+ */
+void for_each_io_count(const std::function<void(const char *, unsigned long)> & f);
+
 void run_io( nix::EvalState & state
            , nix::Value & arg
            , const nix::Pos & pos
            , nix::Value & v
            );
 
+/* Reports the node counts and retained memory of the already-forced part of
+ * an IO value, by node kind and by source position
+ */
+void print_io_stats(nix::Value & v, std::ostream & out);
+
 extern "C" void setup_lib(nix::EvalState & state, nix::Value & v);
+
+/* Gives a freshly forked child its own store connection */
+void reopen_store(nix::EvalState & state);
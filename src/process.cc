@@ -0,0 +1,245 @@
+extern "C" {
+#include <sys/wait.h>
+}
+
+#include "io.hh"
+#include "nix-exec.hh"
+#include "exec.hh"
+#include "event-loop.hh"
+#include "process.hh"
+
+#include <eval-inline.hh>
+
+using boost::format;
+using nix::EvalState;
+using nix::Value;
+using nix::Pos;
+using std::string;
+
+/* A process started by spawn, to be used with wait, read, and wait-any */
+class process_value : public nix::ExternalValueBase {
+  std::ostream & print(std::ostream & str) const override {
+    return str << "<nix-exec process " << handle.pid << " started at " << pos
+        << ">";
+  };
+
+  string showType() const override {
+    return "a nix-exec process";
+  };
+
+  string typeOf() const override {
+    return "nix-exec-process";
+  };
+
+  public:
+  process_handle & handle;
+  const Pos & pos;
+
+  process_value(process_handle & handle, const Pos & pos) :
+    handle(handle), pos(pos) {};
+};
+
+static process_handle & force_process(EvalState & state, Value & v, const Pos & pos) {
+  state.forceValue(v);
+  process_value * proc;
+  auto is_process =  v.type == nix::tExternal
+                  && (proc = dynamic_cast<process_value *>(v.external));
+  if (!is_process)
+    nix::throwTypeError("value is %1% while a nix-exec process was expected, at %2%", v, pos);
+  if (proc->handle.owner != getpid())
+    throw nix::EvalError(format("cannot use a process spawned before nix-exec forked, at %1%")
+      % pos);
+  return proc->handle;
+}
+
+static int exit_code(int status) {
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* The process primitives all take a single argument */
+class process_effect : public effect_value {
+  const char * name;
+
+  std::ostream & print(std::ostream & str) const override {
+    return str << "nix-exec-lib.builtins." << name << " (" << arg << ")";
+  };
+
+  size_t valueSize(std::set<const void *> & seen) const override {
+    auto res = sizeof *this;
+    if (seen.find(&arg) == seen.end()) {
+      seen.insert(&arg);
+      res += nix::valueSize(arg);
+    }
+    return res;
+  };
+
+  protected:
+  Value & arg;
+  const Pos & pos;
+
+  public:
+  process_effect(const char * name, Value & arg, const Pos & pos) :
+    name(name), arg(arg), pos(pos) {};
+
+  void for_each_value(const std::function<void(Value &)> & f) override {
+    f(arg);
+  };
+
+  const Pos & position() const override {
+    return pos;
+  };
+};
+
+class spawn_value : public process_effect {
+  stdio_mode output_mode(EvalState & state, const char * name) {
+    auto mode_val = spec_attr(state, arg, name);
+    if (!mode_val)
+      return stdio_mode::pipe;
+    auto mode = state.forceStringNoCtx(*mode_val, pos);
+    if (mode == "pipe")
+      return stdio_mode::pipe;
+    else if (mode == "inherit")
+      return stdio_mode::inherit;
+    else if (mode == "null")
+      return stdio_mode::null;
+    throw nix::EvalError(format("unknown output mode `%1%', at %2%") % mode % pos);
+  };
+
+  public:
+  spawn_value(Value & spec, const Pos & pos) :
+    process_effect("spawn", spec, pos) {};
+
+  void perform(EvalState & state, Value & v) override {
+    auto ctx = nix::PathSet{};
+    auto input = string{};
+    auto req = read_spawn_spec(state, arg, pos, ctx, input);
+    req.out = output_mode(state, "stdout");
+    req.err = output_mode(state, "stderr");
+
+    auto child = start_process(state, pos, req, ctx);
+    auto handle = new process_handle;
+    handle->pid = child.pid;
+    handle->in = child.in.release();
+    handle->input = std::move(input);
+    handle->out = child.out.release();
+    handle->err = child.err.release();
+    watch_process(*handle);
+
+    v.type = nix::tExternal;
+    v.external = NEW process_value(*handle, pos);
+  };
+};
+
+class wait_value : public process_effect {
+  public:
+  wait_value(Value & proc, const Pos & pos) :
+    process_effect("wait", proc, pos) {};
+
+  void perform(EvalState & state, Value & v) override {
+    auto & handle = force_process(state, arg, pos);
+    run_event_loop([&] {
+      return handle.exited && !handle.out && !handle.err;
+    });
+
+    state.mkAttrs(v, 3);
+    mkInt( *state.allocAttr(v, state.symbols.create("status"))
+         , exit_code(handle.status)
+         );
+    nix::mkString(*state.allocAttr(v, state.symbols.create("stdout")), handle.out_buf);
+    nix::mkString(*state.allocAttr(v, state.symbols.create("stderr")), handle.err_buf);
+    v.attrs->sort();
+    handle.out_buf.clear();
+    handle.err_buf.clear();
+  };
+};
+
+class read_value : public process_effect {
+  /* Takes the next line from buf, or what's left if the pipe is closed */
+  static bool take_line(string & buf, bool open, string & line) {
+    auto nl = buf.find('\n');
+    if (nl == string::npos) {
+      if (open || buf.empty())
+        return false;
+      nl = buf.size();
+    }
+    line = buf.substr(0, nl);
+    buf.erase(0, nl + 1);
+    return true;
+  };
+
+  public:
+  read_value(Value & proc, const Pos & pos) :
+    process_effect("read", proc, pos) {};
+
+  void perform(EvalState & state, Value & v) override {
+    auto & handle = force_process(state, arg, pos);
+    string line;
+    const char * stream = nullptr;
+    run_event_loop([&] {
+      if (take_line(handle.out_buf, bool(handle.out), line))
+        stream = "stdout";
+      else if (take_line(handle.err_buf, bool(handle.err), line))
+        stream = "stderr";
+      return stream || (!handle.out && !handle.err);
+    });
+
+    if (!stream) {
+      nix::mkNull(v);
+      return;
+    }
+    state.mkAttrs(v, 2);
+    nix::mkString(*state.allocAttr(v, state.symbols.create("stream")), stream);
+    nix::mkString(*state.allocAttr(v, state.symbols.create("line")), line);
+    v.attrs->sort();
+  };
+};
+
+class wait_any_value : public process_effect {
+  public:
+  wait_any_value(Value & list, const Pos & pos) :
+    process_effect("wait-any", list, pos) {};
+
+  void perform(EvalState & state, Value & v) override {
+    state.forceList(arg, pos);
+    if (arg.listSize() == 0)
+      throw nix::EvalError(format("wait-any needs at least one process, at %1%") % pos);
+    auto handles = std::vector<process_handle *>{};
+    for (size_t i = 0; i < arg.listSize(); ++i)
+      handles.push_back(&force_process(state, *arg.listElems()[i], pos));
+
+    size_t index = 0;
+    run_event_loop([&] {
+      for (index = 0; index < handles.size(); ++index)
+        if (handles[index]->exited)
+          return true;
+      return false;
+    });
+
+    state.mkAttrs(v, 2);
+    mkInt(*state.allocAttr(v, state.symbols.create("index")), index);
+    mkInt( *state.allocAttr(v, state.symbols.create("status"))
+         , exit_code(handles[index]->status)
+         );
+    v.attrs->sort();
+  };
+};
+
+void prim_spawn(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW spawn_value(*args[0], pos);
+}
+
+void prim_wait(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW wait_value(*args[0], pos);
+}
+
+void prim_read(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW read_value(*args[0], pos);
+}
+
+void prim_wait_any(EvalState & state, const Pos & pos, Value ** args, Value & v) {
+  v.type = nix::tExternal;
+  v.external = NEW wait_any_value(*args[0], pos);
+}
@@ -0,0 +1,33 @@
+namespace nix {
+  class EvalState;
+  struct Value;
+  struct Pos;
+}
+
+/* lib.builtins.spawn */
+void prim_spawn( nix::EvalState & state
+               , const nix::Pos & pos
+               , nix::Value ** args
+               , nix::Value & v
+               );
+
+/* lib.builtins.wait */
+void prim_wait( nix::EvalState & state
+              , const nix::Pos & pos
+              , nix::Value ** args
+              , nix::Value & v
+              );
+
+/* lib.builtins.read */
+void prim_read( nix::EvalState & state
+              , const nix::Pos & pos
+              , nix::Value ** args
+              , nix::Value & v
+              );
+
+/* lib.builtins.wait-any */
+void prim_wait_any( nix::EvalState & state
+                  , const nix::Pos & pos
+                  , nix::Value ** args
+                  , nix::Value & v
+                  );
@@ -0,0 +1,187 @@
+#include <cstdlib>
+#include <climits>
+#include <map>
+#include <set>
+extern "C" {
+#include <unistd.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <util.hh>
+#include <hash.hh>
+#include <eval.hh>
+
+#include "nix-exec.hh"
+#include "expr-cache.hh"
+#include "reexec-cache.hh"
+
+using std::string;
+
+/* Bumped whenever the entry format changes */
+static const char cache_format[] = "nix-exec reexec cache 2";
+
+static string entry_path;
+
+static string script_path;
+
+static string file_hash(const string & path) {
+  return nix::printHash32(nix::hashFile(nix::htSHA256, path));
+}
+
+static string string_hash(const string & s) {
+  return nix::printHash32(nix::hashString(nix::htSHA256, s));
+}
+
+/* What the script read with builtins.readFile and builtins.getEnv while
+ * recording, besides what it imported
+ */
+static std::set<string> files_read;
+static std::map<string, string> env_read;
+
+static nix::Value original_read_file;
+static nix::Value original_get_env;
+
+static void tracked_read_file( nix::EvalState & state
+                             , const nix::Pos & pos
+                             , nix::Value ** args
+                             , nix::Value & v
+                             ) {
+  state.callFunction(original_read_file, *args[0], v, pos);
+  auto context = nix::PathSet{};
+  files_read.insert(state.coerceToPath(pos, *args[0], context));
+}
+
+static void tracked_get_env( nix::EvalState & state
+                           , const nix::Pos & pos
+                           , nix::Value ** args
+                           , nix::Value & v
+                           ) {
+  state.callFunction(original_get_env, *args[0], v, pos);
+  env_read[state.forceStringNoCtx(*args[0], pos)] = state.forceStringNoCtx(v, pos);
+}
+
+/* Replaces builtins.name in place, so every reference to it sees the new one */
+static void hook_builtin( nix::EvalState & state
+                        , const char * name
+                        , nix::PrimOpFun fun
+                        , nix::Value & original
+                        ) {
+  auto var = state.staticBaseEnv.vars.find(state.symbols.create("builtins"));
+  if (var == state.staticBaseEnv.vars.end())
+    return;
+  auto & builtins = *state.baseEnv.values[var->second];
+  auto sym = state.symbols.create(name);
+  auto attr = builtins.attrs->find(sym);
+  if (attr == builtins.attrs->end())
+    return;
+  original = *attr->value;
+  attr->value->type = nix::tPrimOp;
+  attr->value->primOp = new nix::PrimOp(fun, 1, sym);
+}
+
+/* The nix-exec actually running, so that entries made by one installation
+ * aren't used by another that happens to be invoked by the same name
+ */
+static string self_path() {
+  char buf[PATH_MAX];
+  if (realpath("/proc/self/exe", buf))
+    return buf;
+  auto argv0 = string{nixexec_argv[0]};
+  if (argv0.find('/') == string::npos) {
+    for (auto & dir : nix::tokenizeString<nix::Strings>(nix::getEnv("PATH"), ":")) {
+      auto candidate = dir + "/" + argv0;
+      if (access(candidate.c_str(), X_OK) == 0 && realpath(candidate.c_str(), buf))
+        return buf;
+    }
+  } else if (realpath(argv0.c_str(), buf))
+    return buf;
+  return argv0;
+}
+
+/* An entry is the target on the first line, then a line for each input the
+ * script depended on: `file HASH PATH' for files it imported or read, and
+ * `env HASH NAME' for environment variables it read.
+ */
+void reexec_cache_exec(const char * dir) {
+  try {
+    script_path = nix::absPath(nixexec_argv[1]);
+    auto key = string(cache_format) + '\0' + self_path() + '\0' +
+      script_path + '\0' + nix::getEnv("NIX_PATH") + '\0' +
+      nix::readFile(script_path);
+    for (auto i = 2; i < nixexec_argc; ++i)
+      key += '\0' + string(nixexec_argv[i]);
+    entry_path = nix::absPath(dir) + "/" +
+      nix::printHash32(nix::hashString(nix::htSHA256, key));
+
+    if (!nix::pathExists(entry_path))
+      return;
+
+    auto lines = nix::tokenizeString<nix::Strings>(nix::readFile(entry_path), "\n");
+    if (lines.empty())
+      return;
+    auto target = lines.front();
+    lines.pop_front();
+    for (auto & line : lines) {
+      auto fields = nix::tokenizeString<std::vector<string>>(line, " ");
+      if (fields.size() < 3)
+        return;
+      auto hash = fields[1];
+      auto name = line.substr(fields[0].size() + hash.size() + 2);
+      if (fields[0] == "file") {
+        if (!nix::pathExists(name) || file_hash(name) != hash)
+          return;
+      } else if (fields[0] != "env" || string_hash(nix::getEnv(name)) != hash)
+        return;
+    }
+
+    if (access(target.c_str(), X_OK) == -1)
+      return;
+
+    auto old_argv0 = nixexec_argv[0];
+    nixexec_argv[0] = const_cast<char *>(target.c_str());
+    execvp(nixexec_argv[0], nixexec_argv);
+    nixexec_argv[0] = old_argv0;
+  } catch (nix::Error &) {
+    /* Evaluate as usual and let that report any problem */
+  }
+}
+
+bool reexec_cache_recording() {
+  return !entry_path.empty();
+}
+
+void reexec_cache_track(nix::EvalState & state) {
+  track_imports(state);
+  hook_builtin(state, "readFile", tracked_read_file, original_read_file);
+  hook_builtin(state, "getEnv", tracked_get_env, original_get_env);
+}
+
+void reexec_cache_record(const string & target) {
+  if (entry_path.empty())
+    return;
+
+  try {
+    auto entry = target + "\n";
+    auto add_file = [&] (const string & path) {
+      entry += "file " + file_hash(path) + " " + path + "\n";
+    };
+    add_file(script_path);
+    for_each_import(add_file);
+    for (auto & path : files_read)
+      add_file(path);
+    for (auto & var : env_read)
+      entry += "env " + string_hash(var.second) + " " + var.first + "\n";
+
+    nix::createDirs(nix::dirOf(entry_path));
+    auto tmp = entry_path + ".tmp." + std::to_string(getpid());
+    nix::writeFile(tmp, entry);
+    if (rename(tmp.c_str(), entry_path.c_str()) == -1)
+      unlink(tmp.c_str());
+  } catch (nix::Error &) {
+    /* Just evaluate again next time */
+  }
+}
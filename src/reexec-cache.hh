@@ -0,0 +1,22 @@
+#include <string>
+
+namespace nix {
+  class EvalState;
+}
+
+/* If a previous run of this script with these arguments and this nix-exec
+ * reexeced, and the script, everything it imported or read with readFile,
+ * and every variable it read with getEnv are unchanged, execs the same
+ * target straight away. Otherwise returns, and remembers where to record the
+ * target if this run reexecs.
+ */
+void reexec_cache_exec(const char * dir);
+
+/* Whether this run will record its reexec target */
+bool reexec_cache_recording();
+
+/* Makes import, readFile and getEnv record what the script reads */
+void reexec_cache_track(nix::EvalState & state);
+
+/* Records that this run is about to reexec target */
+void reexec_cache_record(const std::string & target);
@@ -12,6 +12,8 @@ extern "C" {
 #include <eval.hh>
 
 #include <nix-exec.hh>
+#include <trace.hh>
+#include <reexec-cache.hh>
 
 using boost::format;
 using nix::Value;
@@ -35,6 +37,8 @@ extern "C" void reexec( nix::EvalState & state
     v.type = nix::tNull;
   } else {
     try {
+      if (!ctx.empty())
+        ++nixexec_store_realisations;
       state.realiseContext(ctx);
     } catch (nix::InvalidPathError & e) {
       throw nix::EvalError(format("cannot exec `%1%', since path `%2%' is not valid, at %3%")
@@ -43,6 +47,8 @@ extern "C" void reexec( nix::EvalState & state
     /* const_cast legal because execvp respects constness */
     auto old_argv0 = nixexec_argv[0];
     nixexec_argv[0] = const_cast<char *>(filename.c_str());
+    reexec_cache_record(filename);
+    trace_prepare_exec();
     execvp(nixexec_argv[0], nixexec_argv);
     nixexec_argv[0] = old_argv0;
     throw nix::SysError(format("executing `%1%'") % filename);
@@ -0,0 +1,522 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+#include <map>
+#include <vector>
+#include <iostream>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <shared.hh>
+#include <store-api.hh>
+#include <eval.hh>
+
+#if HAVE_BOEHMGC
+#include <gc/gc_allocator.h>
+#endif
+
+#include "nix-exec.hh"
+#include "server.hh"
+#include "expr-cache.hh"
+#include "trace.hh"
+
+extern char ** environ;
+
+using boost::format;
+using nix::SysError;
+using nix::Error;
+using std::string;
+
+/* The protocol: the client sends its stdin, stdout and stderr with a one-byte
+ * message, then its working directory, its argv and its environment as
+ * length-prefixed string lists. The server replies with one byte, 0 if it
+ * declines the request (which the client then runs itself), and otherwise
+ * with the exit status as a 32-bit integer once the script has finished.
+ */
+
+static void write_all(int fd, const void * buf, size_t len) {
+  auto p = static_cast<const char *>(buf);
+  while (len) {
+    auto res = write(fd, p, len);
+    if (res == -1) {
+      if (errno == EINTR)
+        continue;
+      throw SysError("writing to nix-exec server connection");
+    }
+    p += res;
+    len -= res;
+  }
+}
+
+/* Returns false on a clean EOF before anything was read */
+static bool read_all(int fd, void * buf, size_t len) {
+  auto p = static_cast<char *>(buf);
+  auto start = p;
+  while (len) {
+    auto res = read(fd, p, len);
+    if (res == -1) {
+      if (errno == EINTR)
+        continue;
+      throw SysError("reading from nix-exec server connection");
+    }
+    if (res == 0) {
+      if (p == start)
+        return false;
+      throw Error("unexpected end of nix-exec server connection");
+    }
+    p += res;
+    len -= res;
+  }
+  return true;
+}
+
+static void write_u32(int fd, uint32_t n) {
+  write_all(fd, &n, sizeof n);
+}
+
+static uint32_t read_u32(int fd) {
+  uint32_t n;
+  if (!read_all(fd, &n, sizeof n))
+    throw Error("unexpected end of nix-exec server connection");
+  return n;
+}
+
+static void write_strings(int fd, const std::vector<string> & strs) {
+  write_u32(fd, strs.size());
+  for (auto & s : strs) {
+    write_u32(fd, s.size());
+    write_all(fd, s.data(), s.size());
+  }
+}
+
+static std::vector<string> read_strings(int fd) {
+  auto count = read_u32(fd);
+  auto res = std::vector<string>{};
+  res.reserve(count);
+  while (count--) {
+    auto s = string(read_u32(fd), '\0');
+    if (!s.empty())
+      read_all(fd, &s[0], s.size());
+    res.push_back(std::move(s));
+  }
+  return res;
+}
+
+static sockaddr_un socket_addr(const char * path) {
+  auto addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path)
+    throw Error(format("socket path `%1%' is too long") % path);
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+int run_client(const char * socket_path, int argc, char ** argv) {
+  auto addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof addr.sun_path)
+    return -1;
+  strcpy(addr.sun_path, socket_path);
+
+  auto fd = nix::AutoCloseFD{socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (fd.get() == -1)
+    return -1;
+  if (connect(fd.get(), reinterpret_cast<sockaddr *>(&addr), sizeof addr) == -1)
+    return -1;
+
+  /* Nothing is run until the server has answered, so if anything goes wrong
+   * before then (including the server refusing us) the script is ours to run
+   */
+  signal(SIGPIPE, SIG_IGN);
+  try {
+    int fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+    char byte = 0;
+    auto iov = iovec{&byte, 1};
+    auto msg = msghdr{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+    if (sendmsg(fd.get(), &msg, 0) == -1)
+      return -1;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof cwd))
+      return -1;
+    write_strings(fd.get(), { cwd });
+    write_strings(fd.get(), std::vector<string>(argv, argv + argc));
+    auto env = std::vector<string>{};
+    for (auto e = environ; *e; ++e)
+      env.push_back(*e);
+    write_strings(fd.get(), env);
+
+    char accepted;
+    if (!read_all(fd.get(), &accepted, sizeof accepted) || !accepted)
+      return -1;
+  } catch (Error &) {
+    return -1;
+  }
+
+  return nix::handleExceptions(argv[0], [&] {
+    int32_t status;
+    if (!read_all(fd.get(), &status, sizeof status))
+      throw Error("the nix-exec server closed the connection without an exit status");
+    throw nix::Exit(status);
+  });
+}
+
+/* Scripts are parsed in the server before forking, so later requests for an
+ * unchanged script reuse the parse. Parsed expressions are allocated by the
+ * collector, so the cache has to be scanned.
+ */
+struct cached_expr {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  nix::Expr * expr;
+};
+
+#if HAVE_BOEHMGC
+typedef std::map< string
+                , cached_expr
+                , std::less<string>
+                , traceable_allocator<std::pair<const string, cached_expr>>
+                > parse_cache;
+#else
+typedef std::map<string, cached_expr> parse_cache;
+#endif
+
+static nix::Expr * cached_parse( nix::EvalState & state
+                               , parse_cache & cache
+                               , const string & path
+                               ) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1)
+    return nullptr;
+
+  auto & entry = cache[path];
+  auto fresh =  entry.expr
+             && entry.dev == st.st_dev
+             && entry.ino == st.st_ino
+             && entry.size == st.st_size
+             && entry.mtime == st.st_mtime;
+  if (!fresh) {
+    entry.expr = nullptr;
+    try {
+      entry.expr = parse_file(state, path);
+    } catch (Error &) {
+      /* Leave the error to be reported to the client */
+      return nullptr;
+    }
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+  }
+  return entry.expr;
+}
+
+static int child_pipe[2];
+
+static void on_sigchld(int) {
+  auto saved = errno;
+  char byte = 0;
+  if (write(child_pipe[1], &byte, 1) == -1) {
+    /* Already a wakeup pending */
+  }
+  errno = saved;
+}
+
+struct request {
+  nix::AutoCloseFD conn;
+  int fds[3];
+  string cwd;
+  std::vector<string> args;
+  std::vector<string> env;
+};
+
+static bool receive_request(int conn, request & req) {
+  char byte;
+  auto iov = iovec{&byte, 1};
+  char control[CMSG_SPACE(sizeof req.fds)];
+  auto msg = msghdr{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  if (recvmsg(conn, &msg, 0) != 1)
+    return false;
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof req.fds))
+    return false;
+  memcpy(req.fds, CMSG_DATA(cmsg), sizeof req.fds);
+
+  try {
+    auto cwd = read_strings(conn);
+    req.args = read_strings(conn);
+    req.env = read_strings(conn);
+    if (cwd.size() != 1 || req.args.size() < 2)
+      throw Error("malformed nix-exec request");
+    req.cwd = cwd[0];
+  } catch (Error & e) {
+    for (auto fd : req.fds)
+      close(fd);
+    std::cerr << "nix-exec server: " << e.msg() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/* Connections waiting for their script to finish, by runner pid. A
+ * connection is -1 once its client has gone away.
+ */
+typedef std::map<pid_t, int> running_map;
+
+[[noreturn]] static void run_request( nix::EvalState & state
+                                    , request & req
+                                    , nix::Expr * expr
+                                    , const request_handler & handler
+                                    , int listener
+                                    , const running_map & running
+                                    ) {
+  signal(SIGCHLD, SIG_DFL);
+  /* Own process group, so that the server can interrupt everything the
+   * script started
+   */
+  setpgid(0, 0);
+  close(child_pipe[0]);
+  close(child_pipe[1]);
+  close(listener);
+  for (auto & r : running)
+    if (r.second != -1)
+      close(r.second);
+  req.conn.close();
+
+  for (int i = 0; i < 3; ++i) {
+    if (dup2(req.fds[i], i) == -1)
+      _exit(1);
+    close(req.fds[i]);
+  }
+
+  auto argv = new char *[req.args.size() + 1];
+  for (size_t i = 0; i < req.args.size(); ++i)
+    argv[i] = strdup(req.args[i].c_str());
+  argv[req.args.size()] = nullptr;
+  nixexec_argc = req.args.size();
+  nixexec_argv = argv;
+
+  auto status = nix::handleExceptions(argv[0], [&] {
+    if (chdir(req.cwd.c_str()) == -1)
+      throw SysError(format("changing directory to `%1%'") % req.cwd);
+    clearenv();
+    for (auto & e : req.env)
+      putenv(strdup(e.c_str()));
+    /* Runners would otherwise all talk over the server's store connection */
+    reopen_store(state);
+    /* The client's trace, if it asked for one, rather than the server's */
+    trace_detach();
+    auto trace_path = getenv("NIX_EXEC_TRACE_FILE");
+    if (trace_path && *trace_path)
+      trace_open(trace_path);
+    handler(expr);
+  });
+  /* The server flushed before forking, so what's buffered now is the
+   * script's own; atexit handlers are the server's
+   */
+  trace_close();
+  std::cout.flush();
+  std::cerr.flush();
+  fflush(stdout);
+  fflush(stderr);
+  _exit(status);
+}
+
+/* The search path is the server's, fixed when it started, so a client with a
+ * different NIX_PATH runs its script itself
+ */
+static bool same_nix_path(const request & req) {
+  auto ours = nix::getEnv("NIX_PATH");
+  auto theirs = string{};
+  for (auto & e : req.env)
+    if (e.compare(0, 9, "NIX_PATH=") == 0)
+      theirs = e.substr(9);
+  return ours == theirs;
+}
+
+/* Only the server's own user may run scripts as the server's user */
+static bool same_user(int conn) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  auto len = socklen_t{sizeof cred};
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    return false;
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(conn, &uid, &gid) == -1)
+    return false;
+  return uid == getuid();
+#endif
+}
+
+void serve( nix::EvalState & state
+          , const char * socket_path
+          , const request_handler & handler
+          ) {
+  auto addr = socket_addr(socket_path);
+  auto listener = nix::AutoCloseFD{socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (listener.get() == -1)
+    throw SysError("creating server socket");
+  fcntl(listener.get(), F_SETFD, FD_CLOEXEC);
+
+  unlink(socket_path);
+  if (bind(listener.get(), reinterpret_cast<sockaddr *>(&addr), sizeof addr) == -1)
+    throw SysError(format("binding to `%1%'") % socket_path);
+  if (listen(listener.get(), 16) == -1)
+    throw SysError(format("listening on `%1%'") % socket_path);
+
+  if (pipe(child_pipe) == -1)
+    throw SysError("creating pipe");
+  for (auto fd : child_pipe) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  struct sigaction act;
+  memset(&act, 0, sizeof act);
+  act.sa_handler = on_sigchld;
+  act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &act, nullptr) == -1)
+    throw SysError("setting SIGCHLD handler");
+
+  auto cache = parse_cache{};
+  auto running = running_map{};
+
+  while (true) {
+    /* Clients send nothing after their request, so any event on a running
+     * connection means the client is gone (e.g. interrupted by ^C)
+     */
+    auto fds = std::vector<pollfd>{ { listener.get(), POLLIN, 0 }
+                                  , { child_pipe[0], POLLIN, 0 }
+                                  };
+    auto pids = std::vector<pid_t>{};
+    for (auto & r : running)
+      if (r.second != -1) {
+        fds.push_back({ r.second, POLLIN, 0 });
+        pids.push_back(r.first);
+      }
+    if (poll(fds.data(), fds.size(), -1) == -1) {
+      if (errno != EINTR)
+        throw SysError("waiting for nix-exec requests");
+      nix::checkInterrupt();
+      continue;
+    }
+
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      auto pid = pids[i - 2];
+      kill(-pid, SIGINT);
+      close(fds[i].fd);
+      running[pid] = -1;
+    }
+
+    if (fds[1].revents) {
+      char buf[64];
+      while (read(child_pipe[0], buf, sizeof buf) > 0);
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto conn = running.find(pid);
+        if (conn == running.end())
+          continue;
+        if (conn->second != -1) {
+          int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) :
+            WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+          /* The client may have gone away, which is its own business */
+          if (write(conn->second, &code, sizeof code) == -1) {}
+          close(conn->second);
+        }
+        running.erase(conn);
+      }
+    }
+
+    if (!fds[0].revents)
+      continue;
+    request req;
+    req.conn = accept(listener.get(), nullptr, nullptr);
+    if (req.conn.get() == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      throw SysError("accepting nix-exec connection");
+    }
+    fcntl(req.conn.get(), F_SETFD, FD_CLOEXEC);
+    if (!same_user(req.conn.get())) {
+      std::cerr << "nix-exec server: refusing a connection from another user"
+                << std::endl;
+      continue;
+    }
+    /* Don't let a stalled client hold up everyone else */
+    auto timeout = timeval{5, 0};
+    setsockopt(req.conn.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    if (!receive_request(req.conn.get(), req))
+      continue;
+
+    char accepted = same_nix_path(req);
+    if (write(req.conn.get(), &accepted, sizeof accepted) != 1 || !accepted) {
+      for (auto fd : req.fds)
+        close(fd);
+      continue;
+    }
+
+    auto & script = req.args[1];
+    auto expr = script[0] == '<' ?
+      nullptr :
+      cached_parse(state, cache, nix::absPath(script, req.cwd));
+
+    trace_flush();
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(stdout);
+    fflush(stderr);
+    auto pid = fork();
+    if (pid == -1) {
+      std::cerr << "nix-exec server: forking: " << strerror(errno) << std::endl;
+      for (auto fd : req.fds)
+        close(fd);
+      continue;
+    } else if (pid == 0)
+      run_request(state, req, expr, handler, listener.get(), running);
+
+    /* As in the child, so it's in place before we might signal it */
+    setpgid(pid, pid);
+    for (auto fd : req.fds)
+      close(fd);
+    running[pid] = req.conn.release();
+  }
+}
@@ -0,0 +1,27 @@
+#include <functional>
+
+namespace nix {
+  class EvalState;
+  struct Expr;
+}
+
+/* Runs one request in a forked process whose stdio, working directory,
+ * environment and nixexec_argv are already the client's. expr is the script
+ * if the server has it parsed already, or nullptr.
+ */
+typedef std::function<void(nix::Expr * expr)> request_handler;
+
+/* Listens on socket_path forever, running each request in a fresh fork of
+ * the warm evaluator so that requests can't see each other's evaluation.
+ */
+void serve( nix::EvalState & state
+          , const char * socket_path
+          , const request_handler & handler
+          );
+
+/* Asks the server at socket_path to run argv with our stdio, working
+ * directory and environment. Returns the script's exit status, or -1 if no
+ * server could be reached or it declined the request (because its NIX_PATH
+ * differs from ours), in which case nothing has been run.
+ */
+int run_client(const char * socket_path, int argc, char ** argv);
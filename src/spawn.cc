@@ -0,0 +1,228 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+}
+
+#include "spawn.hh"
+
+using boost::format;
+using nix::SysError;
+using std::string;
+
+extern char ** environ;
+
+/* argv and envp for exec, pointing into strs */
+static std::vector<char *> c_strings(const std::vector<string> & strs) {
+  auto res = std::vector<char *>{};
+  res.reserve(strs.size() + 1);
+  for (auto & s : strs)
+    res.push_back(const_cast<char *>(s.c_str()));
+  res.push_back(nullptr);
+  return res;
+}
+
+static void make_pipe(nix::AutoCloseFD & ours, nix::AutoCloseFD & theirs, bool read) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1)
+    throw SysError("creating pipe");
+  ours = fds[read ? 0 : 1];
+  theirs = fds[read ? 1 : 0];
+}
+
+#if !HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+/* What posix_spawnp would run, searching our PATH like it does */
+static string find_program(const string & name) {
+  if (name.find('/') != string::npos)
+    return name;
+  auto path = nix::getEnv("PATH", "/bin:/usr/bin");
+  for (auto & dir : nix::tokenizeString<nix::Strings>(path, ":")) {
+    auto candidate = (dir.empty() ? "." : dir) + "/" + name;
+    if (access(candidate.c_str(), X_OK) == 0)
+      return candidate;
+  }
+  return name;
+}
+#endif
+
+spawned_process spawn(const spawn_request & req) {
+  if (req.argv.empty())
+    throw nix::Error("cannot run a program with an empty argv");
+
+  auto res = spawned_process{};
+  nix::AutoCloseFD child_fds[3];
+  int null_fd_target[3] = { -1, -1, -1 };
+  const stdio_mode modes[] = { req.in, req.out, req.err };
+  for (int i = 0; i < 3; ++i) {
+    auto & ours = i == 0 ? res.in : i == 1 ? res.out : res.err;
+    if (modes[i] == stdio_mode::pipe)
+      make_pipe(ours, child_fds[i], i != 0);
+    else if (modes[i] == stdio_mode::null)
+      null_fd_target[i] = i;
+  }
+
+  auto argv = c_strings(req.argv);
+  auto envp = req.inherit_env ? std::vector<char *>{} : c_strings(req.env);
+  auto env = req.inherit_env ? environ : envp.data();
+
+  sigset_t no_signals, default_signals;
+  sigemptyset(&no_signals);
+  sigemptyset(&default_signals);
+  /* nix ignores SIGPIPE, which children shouldn't inherit */
+  sigaddset(&default_signals, SIGPIPE);
+
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+
+  for (int i = 0; i < 3; ++i) {
+    if (child_fds[i])
+      posix_spawn_file_actions_adddup2(&actions, child_fds[i].get(), i);
+    else if (null_fd_target[i] != -1)
+      posix_spawn_file_actions_addopen( &actions
+                                      , i
+                                      , "/dev/null"
+                                      , i == 0 ? O_RDONLY : O_WRONLY
+                                      , 0
+                                      );
+  }
+  if (!req.cwd.empty())
+    posix_spawn_file_actions_addchdir_np(&actions, req.cwd.c_str());
+
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  posix_spawnattr_setsigdefault(&attr, &default_signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  auto err = posix_spawnp(&res.pid, argv[0], &actions, &attr, argv.data(), env);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err) {
+    errno = err;
+    throw SysError(format("executing `%1%'") % req.argv[0]);
+  }
+#else
+  /* Without a way to have posix_spawn change directory, do the same with
+   * vfork. The child only makes system calls until it execs, and reports
+   * failure through memory it shares with us until then.
+   */
+  auto program = find_program(req.argv[0]);
+  auto null_fd = nix::AutoCloseFD{open("/dev/null", O_RDWR | O_CLOEXEC)};
+  volatile int exec_errno = 0;
+  res.pid = vfork();
+  if (res.pid == 0) {
+    for (int i = 0; i < 3; ++i) {
+      auto from = child_fds[i] ? child_fds[i].get() :
+        null_fd_target[i] != -1 ? null_fd.get() : -1;
+      if (from != -1 && dup2(from, i) == -1) {
+        exec_errno = errno;
+        _exit(127);
+      }
+    }
+    if (!req.cwd.empty() && chdir(req.cwd.c_str()) == -1) {
+      exec_errno = errno;
+      _exit(127);
+    }
+    sigprocmask(SIG_SETMASK, &no_signals, nullptr);
+    signal(SIGPIPE, SIG_DFL);
+    execve(program.c_str(), argv.data(), env);
+    exec_errno = errno;
+    _exit(127);
+  }
+  if (res.pid == -1)
+    throw SysError(format("starting `%1%'") % req.argv[0]);
+  if (exec_errno) {
+    wait_process(res.pid);
+    errno = exec_errno;
+    throw SysError(format("executing `%1%'") % req.argv[0]);
+  }
+#endif
+
+  return res;
+}
+
+void communicate( spawned_process & child
+                , const string & input
+                , const std::function<void(int, const char *, size_t)> & on_output
+                ) {
+  size_t written = 0;
+  if (child.in && input.empty())
+    child.in.close();
+  if (child.in)
+    fcntl(child.in.get(), F_SETFL, O_NONBLOCK);
+
+  while (child.in || child.out || child.err) {
+    pollfd fds[3];
+    nix::AutoCloseFD * owners[3];
+    nfds_t count = 0;
+    if (child.in) {
+      fds[count] = pollfd{child.in.get(), POLLOUT, 0};
+      owners[count++] = &child.in;
+    }
+    if (child.out) {
+      fds[count] = pollfd{child.out.get(), POLLIN, 0};
+      owners[count++] = &child.out;
+    }
+    if (child.err) {
+      fds[count] = pollfd{child.err.get(), POLLIN, 0};
+      owners[count++] = &child.err;
+    }
+
+    if (poll(fds, count, -1) == -1) {
+      if (errno != EINTR)
+        throw SysError("waiting for child output");
+      nix::checkInterrupt();
+      continue;
+    }
+
+    for (nfds_t i = 0; i < count; ++i) {
+      if (!fds[i].revents)
+        continue;
+      auto & fd = *owners[i];
+      if (&fd == &child.in) {
+        auto res = write(fd.get(), input.data() + written, input.size() - written);
+        if (res == -1) {
+          if (errno == EAGAIN || errno == EINTR)
+            continue;
+          /* The child stopped reading, which is its business */
+          if (errno == EPIPE) {
+            fd.close();
+            continue;
+          }
+          throw SysError("writing to child");
+        }
+        written += res;
+        if (written == input.size())
+          fd.close();
+        continue;
+      }
+
+      char buf[65536];
+      auto res = read(fd.get(), buf, sizeof buf);
+      if (res == -1) {
+        if (errno == EINTR)
+          continue;
+        throw SysError("reading child output");
+      }
+      if (res == 0)
+        fd.close();
+      else
+        on_output(&fd == &child.out ? 1 : 2, buf, res);
+    }
+  }
+}
+
+int wait_process(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      throw SysError("waiting for child");
+  }
+  return status;
+}
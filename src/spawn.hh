@@ -0,0 +1,54 @@
+#include <string>
+#include <vector>
+#include <functional>
+extern "C" {
+#include <sys/types.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <util.hh>
+
+/* What a spawned child's standard stream is connected to */
+enum class stdio_mode { inherit, pipe, null };
+
+struct spawn_request {
+  /* argv[0] is looked up in PATH if it has no slash */
+  std::vector<std::string> argv;
+  bool inherit_env = true;
+  std::vector<std::string> env;
+  /* Empty to stay in our working directory */
+  std::string cwd;
+  stdio_mode in = stdio_mode::inherit;
+  stdio_mode out = stdio_mode::inherit;
+  stdio_mode err = stdio_mode::inherit;
+};
+
+/* A running child, with our ends of any pipes to it */
+struct spawned_process {
+  pid_t pid;
+  nix::AutoCloseFD in;
+  nix::AutoCloseFD out;
+  nix::AutoCloseFD err;
+};
+
+/* Starts a child without copying our address space, so the cost doesn't grow
+ * with the size of the evaluator's heap. Throws if the program couldn't be
+ * executed.
+ */
+spawned_process spawn(const spawn_request & req);
+
+/* Feeds input to the child's stdin pipe, if it has one, and calls on_output
+ * with each chunk read from its stdout (1) and stderr (2) pipes, until they
+ * are all closed. Nothing blocks on a full pipe while another has data.
+ */
+void communicate( spawned_process & child
+                , const std::string & input
+                , const std::function<void(int, const char *, size_t)> & on_output
+                );
+
+/* Waits for the child to exit, returning its wait status */
+int wait_process(pid_t pid);
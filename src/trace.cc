@@ -0,0 +1,153 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+extern "C" {
+#include <unistd.h>
+}
+
+/* Work around nix's config.h */
+#undef PACKAGE_NAME
+#undef PACKAGE_STRING
+#undef PACKAGE_TARNAME
+#undef PACKAGE_VERSION
+#include <nixexpr.hh>
+#include <util.hh>
+
+#include "trace.hh"
+
+bool tracing = false;
+
+static FILE * trace_file;
+static bool first_event;
+
+static constexpr char append_var[] = "NIX_EXEC_TRACE_APPEND";
+
+/* Wall-clock based so that a reexeced nix-exec's events line up */
+static long long now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+}
+
+static std::string escape(const std::string & s) {
+  auto res = std::string{};
+  res.reserve(s.size() + 2);
+  res += '"';
+  for (auto c : s) {
+    switch (c) {
+      case '"':
+        res += "\\\"";
+        break;
+      case '\\':
+        res += "\\\\";
+        break;
+      case '\n':
+        res += "\\n";
+        break;
+      case '\t':
+        res += "\\t";
+        break;
+      default:
+        if ((unsigned char) c < 0x20) {
+          char buf[7];
+          snprintf(buf, sizeof buf, "\\u%04x", c);
+          res += buf;
+        } else
+          res += c;
+    }
+  }
+  res += '"';
+  return res;
+}
+
+void trace_close() {
+  if (!tracing)
+    return;
+  fputs("\n]\n", trace_file);
+  fclose(trace_file);
+  tracing = false;
+}
+
+void trace_detach() {
+  if (!tracing)
+    return;
+  fclose(trace_file);
+  tracing = false;
+}
+
+void trace_open(const std::string & path) {
+  auto append = getenv(append_var) != nullptr;
+  unsetenv(append_var);
+
+  trace_file = fopen(path.c_str(), append ? "a" : "w");
+  if (!trace_file)
+    throw nix::SysError(boost::format("opening trace file `%1%'") % path);
+  if (!append)
+    fputs("[\n", trace_file);
+  first_event = !append;
+  tracing = true;
+  atexit(trace_close);
+}
+
+void trace_prepare_exec() {
+  if (!tracing)
+    return;
+  fflush(trace_file);
+  setenv(append_var, "1", 1);
+}
+
+void trace_flush() {
+  if (tracing)
+    fflush(trace_file);
+}
+
+void trace_span::begin(const char * cat, const std::string & name) {
+  if (!tracing)
+    return;
+  this->cat = cat;
+  this->name = name;
+  start = now();
+}
+
+void trace_span::arg(const char * key, const std::string & value) {
+  if (!cat)
+    return;
+  if (!args.empty())
+    args += ',';
+  args += escape(key);
+  args += ':';
+  args += escape(value);
+}
+
+void trace_span::arg(const char * key, const nix::Pos & pos) {
+  if (!cat)
+    return;
+  std::ostringstream str;
+  str << pos;
+  arg(key, str.str());
+}
+
+trace_span::~trace_span() {
+  end();
+}
+
+void trace_span::end() {
+  if (!cat || !tracing)
+    return;
+  auto end = now();
+  fprintf( trace_file
+         , "%s{\"name\":%s,\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+           "\"pid\":%ld,\"tid\":0,\"args\":{%s}}"
+         , first_event ? "" : ",\n"
+         , escape(name).c_str()
+         , cat
+         , start
+         , end - start
+         , (long) getpid()
+         , args.c_str()
+         );
+  first_event = false;
+  cat = nullptr;
+  args.clear();
+}
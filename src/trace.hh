@@ -0,0 +1,56 @@
+#include <string>
+
+namespace nix {
+  struct Pos;
+}
+
+/* Chrome/Perfetto trace-event output. When NIX_EXEC_TRACE_FILE is set, each
+ * span is written to it as a complete ("X") event when it ends.
+ */
+extern bool tracing;
+
+void trace_open(const std::string & path);
+
+/* Called right before exec'ing another nix-exec, which appends to the same
+ * trace instead of starting a new one
+ */
+void trace_prepare_exec();
+
+/* Writes out buffered events. Called before forking, so that they aren't
+ * written by both processes, and before a forked child _exits, so that its
+ * own aren't lost.
+ */
+void trace_flush();
+
+/* Finishes the trace. Run at exit, and by forked children that _exit after
+ * opening a trace of their own.
+ */
+void trace_close();
+
+/* Stops a forked child writing to the trace it inherited, which is left to
+ * the parent to finish
+ */
+void trace_detach();
+
+class trace_span {
+  const char * cat = nullptr;
+  std::string name;
+  std::string args;
+  long long start;
+
+  public:
+  trace_span() {};
+  trace_span(const trace_span &) = delete;
+  ~trace_span();
+
+  /* Spans are only recorded if begun, so callers can skip describing them
+   * when tracing is off
+   */
+  void begin(const char * cat, const std::string & name);
+  /* Records the span now rather than when it's destroyed, so it can be
+   * begun again
+   */
+  void end();
+  void arg(const char * key, const std::string & value);
+  void arg(const char * key, const nix::Pos & pos);
+};
@@ -0,0 +1,83 @@
+#!/bin/sh -e
+# fetchgit.sh against local file:// repos: a depth gives a shallow repo, which
+# isn't taken to know its root commit later on, a filter leaves out the blobs
+# the archive doesn't need, a commit the server won't hand out by id is found
+# by fetching all heads and tags, and a submodule of a repo's own older
+# commit doesn't wait on the repo's lock.
+
+dir=$(mktemp -d)
+trap 'chmod -R u+w "$dir"; rm -rf "$dir"' EXIT
+
+# The configured script isn't executable until it's installed
+cp scripts/fetchgit.sh "$dir"/fetchgit.sh
+chmod +x "$dir"/fetchgit.sh
+FETCHGIT_MATERIALIZE=$PWD/fetchgit-materialize
+export FETCHGIT_MATERIALIZE
+
+GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@example.com
+GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@example.com
+export GIT_AUTHOR_NAME GIT_AUTHOR_EMAIL GIT_COMMITTER_NAME GIT_COMMITTER_EMAIL
+
+fail() {
+	echo "$1" >&2
+	exit 1
+}
+
+git init -q "$dir"/work
+for i in 1 2 3; do
+	echo "$i" > "$dir"/work/file
+	git -C "$dir"/work add file
+	git -C "$dir"/work commit -q -m "$i"
+done
+git clone -q --bare "$dir"/work "$dir"/origin.git
+git --git-dir="$dir"/origin.git config uploadpack.allowFilter true
+url=file://"$dir"/origin.git
+head=$(git --git-dir="$dir"/origin.git rev-parse HEAD)
+old=$(git --git-dir="$dir"/origin.git rev-parse HEAD~1)
+
+# fetch CACHE REV DEPTH FILTER: prints the archive
+fetch() {
+	"$dir"/fetchgit.sh "$1" "$url" "$2" false "" "$3" "$4"
+}
+
+check_file() {
+	[ "$(cat "$1"/file)" = "$2" ] || fail "$1 has the wrong contents"
+}
+
+archive=$(fetch "$dir"/depth "$head" 1 "")
+check_file "$archive" 3
+[ -f "$dir"/depth/repos/origin-*/shallow ] || fail "a depth didn't give a shallow repo"
+
+# A repo made shallow by an earlier fetch doesn't know its root either
+fetch "$dir"/reshallow "$old" 1 "" >/dev/null
+fetch "$dir"/reshallow "$head" "" "" >/dev/null
+[ ! -e "$dir"/reshallow/roots/"$old" ] || fail "a shallow repo's boundary was taken for its root"
+
+archive=$(fetch "$dir"/filter "$head" "" blob:none)
+check_file "$archive" 3
+repo=$(echo "$dir"/filter/repos/origin-*/)
+git --git-dir="$repo" rev-list --objects --missing=print "$old"^{tree} | grep -q '^?' ||
+	fail "the filter didn't leave out the blobs of older commits"
+
+# Protocol v0 servers only hand out advertised commits, so the old commit
+# can only be found by fetching everything
+archive=$(
+	GIT_CONFIG_COUNT=1 GIT_CONFIG_KEY_0=protocol.version GIT_CONFIG_VALUE_0=0
+	export GIT_CONFIG_COUNT GIT_CONFIG_KEY_0 GIT_CONFIG_VALUE_0
+	fetch "$dir"/fallback "$old" "" ""
+)
+check_file "$archive" 2
+repo=$(echo "$dir"/fallback/repos/origin-*/)
+[ -n "$(git --git-dir="$repo" for-each-ref refs/remotes/origin)" ] ||
+	fail "a commit that can't be fetched by id didn't fetch all heads"
+
+# The submodule lives in the same cached repo as its superproject
+printf '[submodule "self"]\n\tpath = self\n\turl = %s\n' "$url" > "$dir"/work/.gitmodules
+git -C "$dir"/work add .gitmodules
+git -C "$dir"/work update-index --add --cacheinfo 160000,"$old",self
+git -C "$dir"/work commit -q -m submodule
+git -C "$dir"/work push -q "$dir"/origin.git HEAD
+super=$(git --git-dir="$dir"/origin.git rev-parse HEAD)
+archive=$("$dir"/fetchgit.sh "$dir"/submodule "$url" "$super" true "" "" "")
+check_file "$archive" 3
+check_file "$archive"/self 2
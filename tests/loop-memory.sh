@@ -0,0 +1,54 @@
+#!/bin/sh -e
+# Million-iteration tail-recursive loops, written with bind and with
+# join (map ...), must run in bounded memory. If each iteration kept its
+# continuation reachable, peak RSS would grow well past the ceiling. A
+# left-nested map chain can't be run in constant memory, since every map
+# waits on the one inside it, but its frames must stay small enough that a
+# long chain fits under the same ceiling.
+
+ceiling=262144 # KiB
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# check NAME: runs $dir/NAME.nix and checks its peak RSS
+check() {
+	./nix-exec --stats-json "$dir"/"$1".json "$dir"/"$1".nix
+
+	rss=$(sed -n 's/.*"peakRSS":\([0-9]*\).*/\1/p' "$dir"/"$1".json)
+	if [ -z "$rss" ]; then
+		echo "$1: no peak RSS in the statistics" >&2
+		exit 1
+	fi
+	if [ "$rss" -gt "$ceiling" ]; then
+		echo "$1: peak RSS of $rss KiB exceeds the ceiling of $ceiling KiB" >&2
+		exit 1
+	fi
+}
+
+cat > "$dir"/bind.nix <<'NIX'
+{ lib, ... }: let
+  go = i: if i == 0
+    then lib.unit 0
+    else lib.bind (lib.unit i) (x: go (x - 1));
+in go 1000000
+NIX
+check bind
+
+cat > "$dir"/join-map.nix <<'NIX'
+{ lib, ... }: let
+  go = i: lib.join (lib.map (x: if x == 0
+    then lib.unit 0
+    else go (x - 1)) (lib.unit i));
+in go 1000000
+NIX
+check join-map
+
+cat > "$dir"/map-chain.nix <<'NIX'
+{ lib, ... }: let
+  go = i: if i == 0
+    then lib.unit 0
+    else lib.map (x: x + 1) (go (i - 1));
+in go 100000
+NIX
+check map-chain
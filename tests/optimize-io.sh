@@ -0,0 +1,37 @@
+#!/bin/sh -e
+# --optimize-io must not change what a program does: deep left-nested map and
+# join (map ...) chains give the same results with and without it.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir"/chains.nix <<'NIX'
+{ lib, ... }: let
+  maps = n: if n == 0
+    then lib.unit 0
+    else lib.map (x: x + 1) (maps (n - 1));
+  joins = n: if n == 0
+    then lib.unit 0
+    else lib.join (lib.map (x: lib.unit (x * 2 - x + 1)) (joins (n - 1)));
+  mixed = n: if n == 0
+    then lib.unit 0
+    else lib.map (x: x + 1) (lib.join (lib.unit (mixed (n - 1))));
+in lib.bind (maps 100000) (a:
+  lib.bind (joins 100000) (b:
+    lib.bind (mixed 100000) (c:
+      lib.builtins.exec {
+        argv = [ "echo" (toString a) (toString b) (toString c) ];
+        stdout = "inherit";
+      })))
+NIX
+
+plain=$(./nix-exec "$dir"/chains.nix)
+optimized=$(./nix-exec --optimize-io "$dir"/chains.nix)
+if [ "$plain" != "100000 100000 100000" ]; then
+	echo "unexpected results without --optimize-io: $plain" >&2
+	exit 1
+fi
+if [ "$optimized" != "$plain" ]; then
+	echo "--optimize-io changed the results from $plain to $optimized" >&2
+	exit 1
+fi
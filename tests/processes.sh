@@ -0,0 +1,37 @@
+#!/bin/sh -e
+# Process handles: read yields a program's lines from either stream and then
+# null, wait yields its status and unread output once its input has been
+# fed, and wait-any yields whichever program exits first.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir"/processes.nix <<'NIX'
+{ lib, ... }: let
+  inherit (lib.builtins) spawn read wait exec;
+  wait-any = lib.builtins."wait-any";
+in lib.bind (spawn {
+  argv = [ "sh" "-c" "echo out; echo err >&2; exit 3" ];
+}) (p: lib.bind (read p) (a: lib.bind (read p) (b: lib.bind (read p) (c:
+  lib.bind (wait p) (r:
+    assert builtins.elem { stream = "stdout"; line = "out"; } [ a b ];
+    assert builtins.elem { stream = "stderr"; line = "err"; } [ a b ];
+    assert c == null;
+    assert r.status == 3;
+    lib.bind (spawn { argv = [ "cat" ]; stdin = "one\ntwo\n"; }) (cat:
+      lib.bind (wait cat) (r:
+        assert r == { status = 0; stdout = "one\ntwo\n"; stderr = ""; };
+        lib.bind (spawn { argv = [ "sleep" "1" ]; }) (slow:
+          lib.bind (spawn { argv = [ "sh" "-c" "exit 5" ]; }) (fast:
+            lib.bind (wait-any [ slow fast ]) (first:
+              assert first == { index = 1; status = 5; };
+              lib.bind (wait slow) (r:
+                assert r.status == 0;
+                exec { argv = [ "echo" "ok" ]; stdout = "inherit"; })))))))))))
+NIX
+
+res=$(./nix-exec "$dir"/processes.nix)
+if [ "$res" != ok ]; then
+	echo "unexpected output: $res" >&2
+	exit 1
+fi